@@ -1,12 +1,24 @@
 #include <iostream>
+#include <cstdint>
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <cmath>
+#include <vector>
+#include "expand.cpp"
+#include "input.cpp"
 
 #define SDL_MAIN_NOIMPL
 #include <SDL3/SDL.h>
 
+// keypad 0-F, as in the README's table
+char const *const DEFAULT_KEY_LAYOUT = "x123qweasdzc4rfv";
+
 class Platform
 {
 public:
-    Platform(char const *title, int windowWidth, int windowHeight, int textureWidth, int textureHeight)
+    Platform(char const *title, int windowWidth, int windowHeight, int textureWidth, int textureHeight, int textureScale = 1)
+        : width(textureWidth), height(textureHeight), scale(textureScale)
     {
         if (!SDL_Init(SDL_INIT_VIDEO))
         {
@@ -18,7 +30,7 @@ public:
 
         renderer = SDL_CreateRenderer(window, nullptr);
 
-        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, textureWidth, textureHeight);
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, textureWidth * textureScale, textureHeight * textureScale);
 
         if (window == NULL || renderer == NULL || texture == NULL)
         {
@@ -27,252 +39,243 @@ public:
         }
 
         SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST); // disables blending between pixels
+
+        frameEvent = SDL_RegisterEvents(1);
+        MapKeys(DEFAULT_KEY_LAYOUT);
     }
 
     ~Platform()
     {
+        if (overlay)
+        {
+            SDL_DestroyTexture(overlay);
+        }
         SDL_DestroyTexture(texture);
         SDL_DestroyRenderer(renderer);
         SDL_DestroyWindow(window);
         SDL_Quit();
     }
 
-    void Update(void const *buffer, int pitch)
+    // Expand a framebuffer of one or two bit-planes (rows packed at the
+    // texture width, bit 63 of a row's first word leftmost) through the
+    // palette and scale straight into the texture, then present. plane1 may
+    // be null.
+    void Update(uint64_t const *plane0, uint64_t const *plane1 = nullptr)
     {
-        SDL_UpdateTexture(texture, nullptr, buffer, pitch);
+        void *pixels;
+        int pitch;
 
-        // buffer: the raw pixel data in the format of the texture.
-        // pitch: the number of bytes in a row of pixel data, including padding between lines.
+        int words = (width + 63) / 64 * height;
+        bool secondPlane = plane1 && std::any_of(plane1, plane1 + words, [](uint64_t word)
+                                                 { return word != 0; });
+
+        if (SDL_LockTexture(texture, nullptr, &pixels, &pitch))
+        {
+            if (secondPlane)
+            {
+                uint32_t const colours[4] = {paletteOff, paletteOn, paletteSecond, paletteBoth};
+                ExpandPlanes(plane0, plane1, width, height, scale, colours, pixels, pitch);
+            }
+            else
+            {
+                ExpandFramebuffer(plane0, width, height, scale, paletteOff, paletteOn, pixels, pitch);
+            }
+            SDL_UnlockTexture(texture);
+        }
 
         SDL_RenderClear(renderer);
         SDL_RenderTexture(renderer, texture, nullptr, nullptr);
+
+        if (overlayVisible && overlay)
+        {
+            int outputWidth, outputHeight;
+            SDL_GetCurrentRenderOutputSize(renderer, &outputWidth, &outputHeight);
+
+            float size = outputHeight / 2.0f;
+            SDL_FRect corner = {outputWidth - size, 0, size, size};
+            SDL_RenderTexture(renderer, overlay, nullptr, &corner);
+        }
+
         SDL_RenderPresent(renderer);
     }
 
-    bool ProcessInput(uint8_t *keys)
+    // Show side x side counts (e.g. the profiler's pc heatmap, row by row) in
+    // the top right corner while overlayVisible, brighter for higher counts
+    // on a log scale.
+    void SetOverlay(uint64_t const *counts, int side)
     {
-        bool quit = false;
-
-        SDL_Event event;
-
-        while (SDL_PollEvent(&event))
+        if (!overlay)
         {
-            switch (event.type)
-            {
-            case SDL_EVENT_QUIT:
+            overlay = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, side, side);
+            if (!overlay)
             {
-                quit = true;
+                return;
             }
-            break;
-
-            case SDL_EVENT_KEY_DOWN:
-            {
-                switch (event.key.key)
-                {
-                case SDLK_ESCAPE:
-                {
-                    quit = true;
-                }
-                break;
+            SDL_SetTextureScaleMode(overlay, SDL_SCALEMODE_NEAREST);
+            SDL_SetTextureBlendMode(overlay, SDL_BLENDMODE_BLEND);
+        }
 
-                case SDLK_X:
-                {
-                    keys[0] = 1;
-                }
-                break;
+        uint64_t most = *std::max_element(counts, counts + side * side);
+        double scale = most ? 255.0 / std::log2(1.0 + most) : 0;
 
-                case SDLK_1:
-                {
-                    keys[1] = 1;
-                }
-                break;
+        std::vector<uint32_t> texels(side * side);
+        for (int i = 0; i < side * side; i++)
+        {
+            // red to yellow, unvisited addresses faintly visible
+            uint32_t heat = static_cast<uint32_t>(std::log2(1.0 + counts[i]) * scale);
+            texels[i] = (counts[i] ? 0xE0000000u : 0x60000000u) | (heat * heat / 255) << 8u | std::max(heat, 0x20u);
+        }
 
-                case SDLK_2:
-                {
-                    keys[2] = 1;
-                }
-                break;
+        SDL_UpdateTexture(overlay, nullptr, texels.data(), side * 4);
+        exposed = true;
+    }
 
-                case SDLK_3:
-                {
-                    keys[3] = 1;
-                }
-                break;
+    // Upload and present only if the emulator drew since the last call or
+    // the window needs repainting. Call at most once per display refresh. A
+    // framebuffer size other than the texture's (a mode switch) resizes it.
+    void Present(uint64_t const *plane0, uint64_t const *plane1, int frameWidth, int frameHeight, bool dirty)
+    {
+        if (frameWidth != width || frameHeight != height)
+        {
+            Resize(frameWidth, frameHeight);
+        }
 
-                case SDLK_A:
-                {
-                    keys[4] = 1;
-                }
-                break;
+        if (!dirty && !exposed)
+        {
+            return;
+        }
 
-                case SDLK_Z:
-                {
-                    keys[5] = 1;
-                }
-                break;
+        Update(plane0, plane1);
 
-                case SDLK_E:
-                {
-                    keys[6] = 1;
-                }
-                break;
+        exposed = false;
+        framesPresented++;
+    }
 
-                case SDLK_Q:
-                {
-                    keys[7] = 1;
-                }
-                break;
+    uint64_t framesPresented = 0;
 
-                case SDLK_S:
-                {
-                    keys[8] = 1;
-                }
-                break;
+    // true while the rewind key (Backspace) is held
+    bool rewinding = false;
 
-                case SDLK_D:
-                {
-                    keys[9] = 1;
-                }
-                break;
+    // toggled by F1; main feeds the overlay when built with -DCHIP8_PROFILE
+    bool overlayVisible = false;
 
-                case SDLK_W:
-                {
-                    keys[0xA] = 1;
-                }
-                break;
+    // RGBA32 colours for unlit and lit pixels; with two bit-planes, for
+    // pixels lit only in the second plane and in both
+    uint32_t paletteOff = 0x00000000;
+    uint32_t paletteOn = 0xFFFFFFFF;
+    uint32_t paletteSecond = 0xFF0066FF;
+    uint32_t paletteBoth = 0xFF002266;
 
-                case SDLK_C:
-                {
-                    keys[0xB] = 1;
-                }
-                break;
+    // Block until an event is queued (left for ProcessInput) or the timeout
+    // passes, so input and new frames are handled without polling.
+    void WaitForEvent(int milliseconds)
+    {
+        SDL_WaitEventTimeout(nullptr, milliseconds);
+    }
 
-                case SDLK_4:
-                {
-                    keys[0xC] = 1;
-                }
-                break;
+    // Wake WaitForEvent, e.g. when another thread has a frame ready. Unlike
+    // the rest of Platform this may be called from any thread.
+    void NotifyFrame()
+    {
+        SDL_Event event{};
+        event.type = frameEvent;
+        SDL_PushEvent(&event);
+    }
 
-                case SDLK_R:
-                {
-                    keys[0xD] = 1;
-                }
-                break;
+    // Map keypad key k to the key at layout[k] (a letter or digit, named by
+    // its US layout position), e.g. the default DEFAULT_KEY_LAYOUT. Returns
+    // false and keeps the current map if the layout is not 16 such keys.
+    bool MapKeys(char const *layout)
+    {
+        uint8_t map[SDL_SCANCODE_COUNT];
+        std::fill(std::begin(map), std::end(map), NO_KEY);
 
-                case SDLK_F:
-                {
-                    keys[0xE] = 1;
-                }
-                break;
+        for (uint8_t key = 0; key < 16; key++)
+        {
+            char c = static_cast<char>(std::tolower(static_cast<unsigned char>(layout[key])));
 
-                case SDLK_V:
-                {
-                    keys[0xF] = 1;
-                }
-                break;
-                }
+            if (c >= 'a' && c <= 'z')
+            {
+                map[SDL_SCANCODE_A + (c - 'a')] = key;
             }
-            break;
-
-            case SDL_EVENT_KEY_UP:
+            else if (c >= '1' && c <= '9')
             {
-                switch (event.key.key)
-                {
-                case SDLK_X:
-                {
-                    keys[0] = 0;
-                }
-                break;
-
-                case SDLK_1:
-                {
-                    keys[1] = 0;
-                }
-                break;
-
-                case SDLK_2:
-                {
-                    keys[2] = 0;
-                }
-                break;
+                map[SDL_SCANCODE_1 + (c - '1')] = key;
+            }
+            else if (c == '0')
+            {
+                map[SDL_SCANCODE_0] = key;
+            }
+            else
+            {
+                return false;
+            }
+        }
 
-                case SDLK_3:
-                {
-                    keys[3] = 0;
-                }
-                break;
+        if (layout[16] != '\0')
+        {
+            return false;
+        }
 
-                case SDLK_A:
-                {
-                    keys[4] = 0;
-                }
-                break;
+        std::copy(std::begin(map), std::end(map), keymap);
+        return true;
+    }
 
-                case SDLK_Z:
-                {
-                    keys[5] = 0;
-                }
-                break;
+    // Handle pending events. Keypad changes go to input stamped with the
+    // host time SDL received them. Returns true once the user quits.
+    bool ProcessInput(InputQueue &input)
+    {
+        bool quit = false;
 
-                case SDLK_E:
-                {
-                    keys[6] = 0;
-                }
-                break;
+        // SDL stamps events on its own clock
+        uint64_t offset = InputQueue::Now() - SDL_GetTicksNS();
 
-                case SDLK_Q:
-                {
-                    keys[7] = 0;
-                }
-                break;
+        SDL_Event event;
 
-                case SDLK_S:
-                {
-                    keys[8] = 0;
-                }
-                break;
+        while (SDL_PollEvent(&event))
+        {
+            switch (event.type)
+            {
+            case SDL_EVENT_QUIT:
+            {
+                quit = true;
+            }
+            break;
 
-                case SDLK_D:
-                {
-                    keys[9] = 0;
-                }
-                break;
+            case SDL_EVENT_WINDOW_EXPOSED:
+            case SDL_EVENT_WINDOW_RESIZED:
+            {
+                exposed = true;
+            }
+            break;
 
-                case SDLK_W:
-                {
-                    keys[0xA] = 0;
-                }
-                break;
+            case SDL_EVENT_KEY_DOWN:
+            case SDL_EVENT_KEY_UP:
+            {
+                bool down = event.type == SDL_EVENT_KEY_DOWN;
+                SDL_Scancode code = event.key.scancode;
 
-                case SDLK_C:
+                if (event.key.repeat)
                 {
-                    keys[0xB] = 0;
+                    break;
                 }
-                break;
 
-                case SDLK_4:
+                if (code == SDL_SCANCODE_ESCAPE)
                 {
-                    keys[0xC] = 0;
+                    quit = quit || down;
                 }
-                break;
-
-                case SDLK_R:
+                else if (code == SDL_SCANCODE_BACKSPACE)
                 {
-                    keys[0xD] = 0;
+                    rewinding = down;
                 }
-                break;
-
-                case SDLK_F:
+                else if (code == SDL_SCANCODE_F1 && down)
                 {
-                    keys[0xE] = 0;
+                    overlayVisible = !overlayVisible;
+                    exposed = true;
                 }
-                break;
-
-                case SDLK_V:
+                else if (code >= 0 && code < SDL_SCANCODE_COUNT && keymap[code] != NO_KEY)
                 {
-                    keys[0xF] = 0;
-                }
-                break;
+                    input.Push({event.key.timestamp + offset, keymap[code], static_cast<uint8_t>(down ? 1 : 0)});
                 }
             }
             break;
@@ -283,7 +286,37 @@ public:
     }
 
 private:
+    // Recreate the streaming texture for a textureWidth x textureHeight
+    // framebuffer, adjusting the scale so the texture keeps about the same
+    // number of pixels.
+    void Resize(int textureWidth, int textureHeight)
+    {
+        scale = std::max(1, width * scale / textureWidth);
+        width = textureWidth;
+        height = textureHeight;
+
+        SDL_DestroyTexture(texture);
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, width * scale, height * scale);
+
+        if (texture == NULL)
+        {
+            std::cout << "error in resizing texture: " << SDL_GetError() << std::endl;
+            std::exit(1);
+        }
+
+        SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
+        exposed = true;
+    }
+
     SDL_Window *window{};
     SDL_Renderer *renderer{};
     SDL_Texture *texture{};
+    SDL_Texture *overlay{};
+    Uint32 frameEvent{};
+    static constexpr uint8_t NO_KEY = 0xFF;
+    uint8_t keymap[SDL_SCANCODE_COUNT]; // keypad key by scancode, or NO_KEY
+    bool exposed = true;
+    int width;
+    int height;
+    int scale;
 };
@@ -1,22 +1,322 @@
+#pragma once
 #include <iostream>
-#include <fstream>
 #include <cstdint>
 #include <random>
 #include <chrono>
 #include <cstring>
 #include <iomanip>
+#include <memory>
+#include <array>
+#include "trace.cpp"
+#include "profile.cpp"
+#include "mapfile.cpp"
 
 const unsigned int START_ADDRESS = 0x200;
 const unsigned int FONTSET_SIZE = 80;
 const unsigned int FONTSET_START_ADDRESS = 0x50;
+const unsigned int BIG_FONTSET_SIZE = 160;
+const unsigned int BIG_FONTSET_START_ADDRESS = 0xA0;
+const unsigned int TIMER_HZ = 60;
+const unsigned int DEFAULT_CYCLES_PER_FRAME = 10;
+const uint32_t IDLE_CHECK_INTERVAL = 64; // instructions between idle loop checks when skipping
+
+// The screen is SCREEN_WIDTH x SCREEN_HEIGHT, or HIRES_WIDTH x HIRES_HEIGHT
+// after SUPER-CHIP's 00FF. Each of the PLANES bit-planes (XO-CHIP) holds its
+// rows packed at the current width: Chip8::ScreenWords() words per row.
 const unsigned int SCREEN_WIDTH = 64;
 const unsigned int SCREEN_HEIGHT = 32;
+const unsigned int HIRES_WIDTH = 128;
+const unsigned int HIRES_HEIGHT = 64;
+const unsigned int PLANE_WORDS = HIRES_WIDTH / 64 * HIRES_HEIGHT;
+const unsigned int PLANES = 2;
+
+const unsigned int MEMORY_SIZE = 0x10000; // XO-CHIP's 64 KB
+const unsigned int ADDRESS_MASK = MEMORY_SIZE - 1; // addresses wrap instead of overrunning memory[]
+const unsigned int MAX_ROM_SIZE = MEMORY_SIZE - START_ADDRESS;
+
+// Jumps and calls only reach the first 4 KB, so that is where code runs; the
+// decode cache and the JIT cover just this range and anything past it is
+// decoded on every execution.
+const unsigned int CODE_SIZE = 0x1000;
+
+// Instruction dispatch backends. Table is the original two-level member
+// function pointer lookup, Switch decodes through one flat switch so the
+// handlers can be inlined, Cached runs from the pre-decoded instruction cache.
+// Build with -DCHIP8_TABLE_DISPATCH or -DCHIP8_SWITCH_DISPATCH to make Cycle()
+// use one of the uncached backends.
+enum class Backend
+{
+	Table,
+	Switch,
+	Cached
+};
+
+#if defined(CHIP8_TABLE_DISPATCH)
+constexpr Backend DEFAULT_BACKEND = Backend::Table;
+#elif defined(CHIP8_SWITCH_DISPATCH)
+constexpr Backend DEFAULT_BACKEND = Backend::Switch;
+#else
+constexpr Backend DEFAULT_BACKEND = Backend::Cached;
+#endif
+
+// Park-Miller minimal standard generator. Its whole state is one word, so it
+// can be saved and restored with the rest of the machine.
+struct Chip8Rng
+{
+	uint32_t state = 1;
+
+	void seed(uint64_t value)
+	{
+		state = static_cast<uint32_t>(value % 2147483647u);
+		if (state == 0)
+		{
+			state = 1;
+		}
+	}
+
+	uint8_t NextByte()
+	{
+		state = static_cast<uint32_t>(static_cast<uint64_t>(state) * 48271u % 2147483647u);
+		return static_cast<uint8_t>(state >> 8u);
+	}
+};
+
+typedef std::array<uint8_t, MEMORY_SIZE> MemoryImage;
+
+const uint8_t FONTSET[FONTSET_SIZE] = {
+	0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+	0x20, 0x60, 0x20, 0x20, 0x70, // 1
+	0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+	0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+	0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+	0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+	0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+	0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+	0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+	0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+	0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+	0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+	0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+	0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+	0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+	0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+};
+
+// 8x10 digits for SUPER-CHIP's Fx30, with XO-CHIP's A-F
+const uint8_t BIG_FONTSET[BIG_FONTSET_SIZE] = {
+	0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+	0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+	0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+	0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+	0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+	0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+	0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+	0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+	0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+	0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+	0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+	0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+// FNV-1a, used to identify memory images and machine states
+inline uint64_t Fnv1a(void const *data, size_t size)
+{
+	uint8_t const *bytes = static_cast<uint8_t const *>(data);
+	uint64_t hash = 14695981039346656037ull;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+enum class RomError
+{
+	None,
+	Open,	 // missing, unreadable or not a regular file
+	Empty,
+	TooLarge // more than MAX_ROM_SIZE bytes
+};
+
+inline char const *RomErrorString(RomError error)
+{
+	switch (error)
+	{
+	case RomError::None:
+		return "ok";
+	case RomError::Open:
+		return "cannot open ROM";
+	case RomError::Empty:
+		return "ROM is empty";
+	case RomError::TooLarge:
+		return "ROM does not fit in memory";
+	}
+	return "unknown error";
+}
+
+inline RomError CheckRomSize(size_t size)
+{
+	return size == 0 ? RomError::Empty : size > MAX_ROM_SIZE ? RomError::TooLarge : RomError::None;
+}
+
+// The memory a machine starts from: the fontsets, then the ROM at
+// START_ADDRESS. The image is immutable, so any number of machines can share
+// it through LoadImage. size must pass CheckRomSize.
+inline std::shared_ptr<MemoryImage const> BuildRomImage(uint8_t const *rom, size_t size)
+{
+	auto image = std::make_shared<MemoryImage>();
+	image->fill(0);
+	memcpy(image->data() + FONTSET_START_ADDRESS, FONTSET, FONTSET_SIZE);
+	memcpy(image->data() + BIG_FONTSET_START_ADDRESS, BIG_FONTSET, BIG_FONTSET_SIZE);
+	memcpy(image->data() + START_ADDRESS, rom, size);
+	return image;
+}
+
+// Map a ROM file and build its image with a single copy. Returns null and
+// sets error if the file cannot be used.
+inline std::shared_ptr<MemoryImage const> LoadRomImage(char const *filename, RomError &error)
+{
+	MappedFile file;
+
+	error = file.Open(filename) ? CheckRomSize(file.Size()) : RomError::Open;
+	return error == RomError::None ? BuildRomImage(file.Data(), file.Size()) : nullptr;
+}
+
+// Behaviours that differ between CHIP-8 interpreters; ROMs written for one
+// may misbehave on another. Chip8::quirks holds a set of these bits. The
+// interpreter is a template over them, and each profile below compiles into
+// its own specialized copy with the quirk tests folded away. Any other
+// combination runs on the QUIRKS_DYNAMIC copy, which reads Chip8::quirks.
+enum QuirkBit : unsigned
+{
+	QUIRK_SHIFT_VY = 1u << 0,	  // 8xy6/8xyE shift Vy into Vx instead of shifting Vx
+	QUIRK_LOAD_STORE_I = 1u << 1, // Fx55/Fx65 advance I by x + 1
+	QUIRK_LOAD_STORE_X = 1u << 2, // Fx55/Fx65 advance I by x (CHIP-48)
+	QUIRK_JUMP_VX = 1u << 3,	  // Bxnn jumps to xnn + Vx instead of nnn + V0
+	QUIRK_CLIP = 1u << 4		  // Dxyn clips at the screen edges instead of wrapping
+};
+
+const unsigned QUIRKS_DYNAMIC = ~0u;
+
+const unsigned PROFILE_LEGACY = 0; // this core's original behaviour
+const unsigned PROFILE_VIP = QUIRK_SHIFT_VY | QUIRK_LOAD_STORE_I | QUIRK_CLIP;
+const unsigned PROFILE_CHIP48 = QUIRK_LOAD_STORE_X | QUIRK_JUMP_VX | QUIRK_CLIP;
+const unsigned PROFILE_SCHIP = QUIRK_JUMP_VX | QUIRK_CLIP;
+
+struct QuirkProfile
+{
+	char const *name;
+	unsigned quirks;
+};
+
+const QuirkProfile QUIRK_PROFILES[] = {
+	{"legacy", PROFILE_LEGACY},
+	{"vip", PROFILE_VIP},
+	{"chip48", PROFILE_CHIP48},
+	{"schip", PROFILE_SCHIP}};
+
+// Look up a profile by name; returns false if there is none.
+inline bool FindQuirkProfile(char const *name, unsigned &quirks)
+{
+	for (QuirkProfile const &profile : QUIRK_PROFILES)
+	{
+		if (strcmp(profile.name, name) == 0)
+		{
+			quirks = profile.quirks;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Every leaf handler once, in the order of Chip8::HANDLERS after its two
+// OP_NULL slots: X(handler, its template arguments under quirk profile Q,
+// name in profiles). HANDLERS, HANDLER_NAMES, HandlerId and the cached
+// backend's switch are all generated from it, so they cannot drift apart.
+#define CHIP8_LEAF_HANDLERS(X, Q) \
+	X(OP_00E0, , "00E0") \
+	X(OP_00EE, , "00EE") \
+	X(OP_1nnn, , "1nnn") \
+	X(OP_2nnn, , "2nnn") \
+	X(OP_3xkk, , "3xkk") \
+	X(OP_4xkk, , "4xkk") \
+	X(OP_5xy0, , "5xy0") \
+	X(OP_6xkk, , "6xkk") \
+	X(OP_7xkk, , "7xkk") \
+	X(OP_8xy0, , "8xy0") \
+	X(OP_8xy1, , "8xy1") \
+	X(OP_8xy2, , "8xy2") \
+	X(OP_8xy3, , "8xy3") \
+	X(OP_8xy4, , "8xy4") \
+	X(OP_8xy5, , "8xy5") \
+	X(OP_8xy6, <Q>, "8xy6") \
+	X(OP_8xy7, , "8xy7") \
+	X(OP_8xyE, <Q>, "8xyE") \
+	X(OP_9xy0, , "9xy0") \
+	X(OP_Annn, , "Annn") \
+	X(OP_Bnnn, <Q>, "Bnnn") \
+	X(OP_Cxkk, , "Cxkk") \
+	X(OP_Dxyn, <Q>, "Dxyn") \
+	X(OP_Ex9E, , "Ex9E") \
+	X(OP_ExA1, , "ExA1") \
+	X(OP_Fx07, , "Fx07") \
+	X(OP_Fx0A, , "Fx0A") \
+	X(OP_Fx15, , "Fx15") \
+	X(OP_Fx18, , "Fx18") \
+	X(OP_Fx1E, , "Fx1E") \
+	X(OP_Fx29, , "Fx29") \
+	X(OP_Fx33, , "Fx33") \
+	X(OP_Fx55, <Q>, "Fx55") \
+	X(OP_Fx65, <Q>, "Fx65") \
+	X(OP_00Cn, , "00Cn") \
+	X(OP_00Dn, , "00Dn") \
+	X(OP_00FB, , "00FB") \
+	X(OP_00FC, , "00FC") \
+	X(OP_00FD, , "00FD") \
+	X(OP_00FE, , "00FE") \
+	X(OP_00FF, , "00FF") \
+	X(OP_5xy2, , "5xy2") \
+	X(OP_5xy3, , "5xy3") \
+	X(OP_F000, , "F000") \
+	X(OP_Fn01, , "Fn01") \
+	X(OP_F002, , "F002") \
+	X(OP_Fx30, , "Fx30") \
+	X(OP_Fx3A, , "Fx3A") \
+	X(OP_Fx75, , "Fx75") \
+	X(OP_Fx85, , "Fx85")
+
+// Index into Chip8::HANDLERS, as stored in DecodedOp::handler.
+enum HandlerId : uint8_t
+{
+	HANDLER_UNDECODED, // not decoded yet
+	HANDLER_INVALID,   // OP_NULL
+#define CHIP8_HANDLER_ID(handler, args, name) HANDLER_##handler,
+	CHIP8_LEAF_HANDLERS(CHIP8_HANDLER_ID, )
+#undef CHIP8_HANDLER_ID
+	HANDLER_ID_COUNT
+};
+
+// Pre-decoded instruction for one address: the opcode and the index of its
+// leaf handler in Chip8::HANDLERS, so executing it skips the fetch and the
+// nested table lookups.
+struct DecodedOp
+{
+	uint16_t opcode;
+	uint8_t handler; // HandlerId
+};
 
 class Chip8
 {
 public:
+	typedef void (Chip8::*Chip8Func)();
+
 	uint8_t registers[16];
-	uint8_t memory[4096];
+	uint8_t memory[MEMORY_SIZE];
 	uint16_t pc;
 	uint16_t index;
 	uint16_t stack[16];
@@ -24,67 +324,116 @@ public:
 	uint8_t delayTimer;
 	uint8_t soundTimer;
 	uint8_t keypad[16];
-	uint32_t screen[SCREEN_WIDTH * SCREEN_HEIGHT];
+	uint64_t screen[PLANES][PLANE_WORDS]; // one bit per pixel, bit 63 of a row's first word is its leftmost column
+	bool screenDirty; // set when screen changes, cleared by the host once presented
+	bool hires;		  // HIRES_WIDTH x HIRES_HEIGHT (00FF) instead of SCREEN_WIDTH x SCREEN_HEIGHT (00FE)
+	uint8_t planes;	  // mask of the bit-planes drawn, cleared and scrolled (Fn01)
+	uint8_t flags[16];		  // SUPER-CHIP user flags (Fx75, Fx85)
+	uint8_t audioPattern[16]; // XO-CHIP sample loop (F002), one bit per sample
+	uint8_t pitch;			  // XO-CHIP sample rate (Fx3A)
 	uint16_t opcode;
-	uint8_t fontset[FONTSET_SIZE] = {
-		0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-		0x20, 0x60, 0x20, 0x20, 0x70, // 1
-		0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-		0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-		0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-		0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-		0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-		0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-		0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-		0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-		0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-		0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-		0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-		0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-		0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-		0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-	};
 
-	Chip8()
-		: randGen(std::chrono::system_clock::now().time_since_epoch().count())
+	// Scheduler: instructions run in frames of cyclesPerFrame, and the timers
+	// tick once at the end of every frame (TIMER_HZ frames per emulated second).
+	uint64_t cycles;
+	uint32_t frameCycle;
+	uint32_t cyclesPerFrame;
+
+	// Idle skipping: with skipIdle set, RunCycles checks every
+	// IDLE_CHECK_INTERVAL instructions for a loop that cannot change the
+	// machine before the next timer tick (IdleLoopLength) and accounts the
+	// rest of the frame at once, leaving the state spinning would have.
+	// Traces and profiles miss the skipped instructions.
+	bool skipIdle = false;
+	uint64_t idleCycles = 0; // cycles accounted without executing them
+
+	unsigned quirks = PROFILE_LEGACY; // QuirkBits; set before running, the JIT reads them while translating
+
+	Chip8() : Chip8(std::chrono::system_clock::now().time_since_epoch().count()) {}
+
+	// Seed Cxkk explicitly so a run can be reproduced (see movie.cpp)
+	explicit Chip8(uint64_t seed)
 	{
+		randGen.seed(seed);
+
+		// clear machine state so runs are reproducible
+		memset(registers, 0, sizeof(registers));
+		memset(memory, 0, sizeof(memory));
+		memset(stack, 0, sizeof(stack));
+		memset(keypad, 0, sizeof(keypad));
+		memset(screen, 0, sizeof(screen));
+		screenDirty = true;
+		hires = false;
+		planes = 1;
+		memset(flags, 0, sizeof(flags));
+		memset(audioPattern, 0, sizeof(audioPattern));
+		pitch = 64;
+		memset(decoded, 0, sizeof(decoded));
+		index = 0;
+		sp = 0;
+		delayTimer = 0;
+		soundTimer = 0;
+		opcode = 0;
+		cycles = 0;
+		frameCycle = 0;
+		cyclesPerFrame = DEFAULT_CYCLES_PER_FRAME;
+
 		// init pc
 		pc = START_ADDRESS;
 
-		// load fontset into ROM from 0x50 to 0x9F
+		// load fontset into ROM from 0x50 to 0x9F, and the big one after it
 		for (int i = 0; i < FONTSET_SIZE; i++)
 		{
-			memory[FONTSET_START_ADDRESS + i] = fontset[i];
+			memory[FONTSET_START_ADDRESS + i] = FONTSET[i];
 		}
-
-		randByte = std::uniform_int_distribution<uint8_t>(0, 255U);
+		memcpy(memory + BIG_FONTSET_START_ADDRESS, BIG_FONTSET, BIG_FONTSET_SIZE);
 
 		table[0x0] = &Chip8::Table0;
 		table[0x1] = &Chip8::OP_1nnn;
 		table[0x2] = &Chip8::OP_2nnn;
 		table[0x3] = &Chip8::OP_3xkk;
 		table[0x4] = &Chip8::OP_4xkk;
-		table[0x5] = &Chip8::OP_5xy0;
+		table[0x5] = &Chip8::Table5;
 		table[0x6] = &Chip8::OP_6xkk;
 		table[0x7] = &Chip8::OP_7xkk;
 		table[0x8] = &Chip8::Table8;
 		table[0x9] = &Chip8::OP_9xy0;
 		table[0xA] = &Chip8::OP_Annn;
-		table[0xB] = &Chip8::OP_Bnnn;
+		table[0xB] = &Chip8::OP_Bnnn<QUIRKS_DYNAMIC>;
 		table[0xC] = &Chip8::OP_Cxkk;
-		table[0xD] = &Chip8::OP_Dxyn;
+		table[0xD] = &Chip8::OP_Dxyn<QUIRKS_DYNAMIC>;
 		table[0xE] = &Chip8::TableE;
 		table[0xF] = &Chip8::TableF;
 
-		for (size_t i = 0; i <= 0xE; i++)
+		for (size_t i = 0; i <= 0xF; i++)
 		{
-			table0[i] = &Chip8::OP_NULL;
+			table5[i] = &Chip8::OP_NULL;
 			table8[i] = &Chip8::OP_NULL;
 			tableE[i] = &Chip8::OP_NULL;
 		}
 
-		table0[0x0] = &Chip8::OP_00E0;
-		table0[0xE] = &Chip8::OP_00EE;
+		for (size_t i = 0; i <= 0xFF; i++)
+		{
+			table0[i] = &Chip8::OP_NULL;
+		}
+
+		for (size_t n = 0; n <= 0xF; n++)
+		{
+			table0[0xC0 | n] = &Chip8::OP_00Cn;
+			table0[0xD0 | n] = &Chip8::OP_00Dn;
+		}
+
+		table0[0xE0] = &Chip8::OP_00E0;
+		table0[0xEE] = &Chip8::OP_00EE;
+		table0[0xFB] = &Chip8::OP_00FB;
+		table0[0xFC] = &Chip8::OP_00FC;
+		table0[0xFD] = &Chip8::OP_00FD;
+		table0[0xFE] = &Chip8::OP_00FE;
+		table0[0xFF] = &Chip8::OP_00FF;
+
+		table5[0x0] = &Chip8::OP_5xy0;
+		table5[0x2] = &Chip8::OP_5xy2;
+		table5[0x3] = &Chip8::OP_5xy3;
 
 		table8[0x0] = &Chip8::OP_8xy0;
 		table8[0x1] = &Chip8::OP_8xy1;
@@ -92,32 +441,50 @@ public:
 		table8[0x3] = &Chip8::OP_8xy3;
 		table8[0x4] = &Chip8::OP_8xy4;
 		table8[0x5] = &Chip8::OP_8xy5;
-		table8[0x6] = &Chip8::OP_8xy6;
+		table8[0x6] = &Chip8::OP_8xy6<QUIRKS_DYNAMIC>;
 		table8[0x7] = &Chip8::OP_8xy7;
-		table8[0xE] = &Chip8::OP_8xyE;
+		table8[0xE] = &Chip8::OP_8xyE<QUIRKS_DYNAMIC>;
 
 		tableE[0x1] = &Chip8::OP_ExA1;
 		tableE[0xE] = &Chip8::OP_Ex9E;
 
-		for (size_t i = 0; i <= 0x65; i++)
+		for (size_t i = 0; i <= 0xFF; i++)
 		{
 			tableF[i] = &Chip8::OP_NULL;
 		}
 
+		tableF[0x00] = &Chip8::OP_F000;
+		tableF[0x01] = &Chip8::OP_Fn01;
+		tableF[0x02] = &Chip8::OP_F002;
 		tableF[0x07] = &Chip8::OP_Fx07;
 		tableF[0x0A] = &Chip8::OP_Fx0A;
 		tableF[0x15] = &Chip8::OP_Fx15;
 		tableF[0x18] = &Chip8::OP_Fx18;
 		tableF[0x1E] = &Chip8::OP_Fx1E;
 		tableF[0x29] = &Chip8::OP_Fx29;
+		tableF[0x30] = &Chip8::OP_Fx30;
 		tableF[0x33] = &Chip8::OP_Fx33;
-		tableF[0x55] = &Chip8::OP_Fx55;
-		tableF[0x65] = &Chip8::OP_Fx65;
+		tableF[0x3A] = &Chip8::OP_Fx3A;
+		tableF[0x55] = &Chip8::OP_Fx55<QUIRKS_DYNAMIC>;
+		tableF[0x65] = &Chip8::OP_Fx65<QUIRKS_DYNAMIC>;
+		tableF[0x75] = &Chip8::OP_Fx75;
+		tableF[0x85] = &Chip8::OP_Fx85;
 	};
 
+	// 0nnn other than 00nn is a machine code routine, which is ignored
+	Chip8Func Leaf0(uint16_t code) const
+	{
+		return code & 0x0F00u ? &Chip8::OP_NULL : table0[code & 0x00FFu];
+	}
+
 	void Table0()
 	{
-		((*this).*(table0[opcode & 0x000Fu]))();
+		((*this).*(Leaf0(opcode)))();
+	}
+
+	void Table5()
+	{
+		((*this).*(table5[opcode & 0x000Fu]))();
 	}
 
 	void Table8()
@@ -135,27 +502,90 @@ public:
 		((*this).*(tableF[opcode & 0x00FFu]))();
 	}
 
-	typedef void (Chip8::*Chip8Func)();
 	Chip8Func table[0xF + 1];
-	Chip8Func table0[0xE + 1];
-	Chip8Func table8[0xE + 1];
-	Chip8Func tableE[0xE + 1];
-	Chip8Func tableF[0x65 + 1];
-
-	std::default_random_engine randGen;
-	std::uniform_int_distribution<uint8_t> randByte;
-
-	void LoadROM(char const *filename);
+	Chip8Func table0[0xFF + 1];
+	Chip8Func table5[0xF + 1];
+	Chip8Func table8[0xF + 1];
+	Chip8Func tableE[0xF + 1];
+	Chip8Func tableF[0xFF + 1];
+
+	static const Chip8Func HANDLERS[];
+	static char const *const HANDLER_NAMES[];
+	static const size_t HANDLER_COUNT;
+	DecodedOp decoded[CODE_SIZE];
+
+	Chip8Rng randGen;
+
+	// memory as it was right after LoadROM (fontset + ROM), shared with every
+	// machine loaded from the same image; save states store only the pages
+	// that differ from it
+	std::shared_ptr<MemoryImage const> loadedImage;
+	uint64_t loadedHash = 0;
+
+	TraceSink trace;
+	ProfileSink profile;
+
+	// Called after the core writes to memory so translated code can be dropped.
+	void (*codeWriteHook)(void *context, uint16_t address, uint16_t length) = nullptr;
+	void *codeWriteContext = nullptr;
+
+	RomError LoadROM(char const *filename);
+	void LoadImage(std::shared_ptr<MemoryImage const> image, DecodedOp const *predecoded = nullptr);
 	void Cycle();
-	void logOP();
+	template <Backend B = DEFAULT_BACKEND>
+	void RunCycles(uint64_t n);
+	template <Backend B = DEFAULT_BACKEND>
+	void RunFrame();
+	uint32_t CyclesToFrameEnd() const { return frameCycle < cyclesPerFrame ? cyclesPerFrame - frameCycle : 1; }
+	unsigned ScreenWidth() const { return hires ? HIRES_WIDTH : SCREEN_WIDTH; }
+	unsigned ScreenHeight() const { return hires ? HIRES_HEIGHT : SCREEN_HEIGHT; }
+	unsigned ScreenWords() const { return ScreenWidth() / 64; }
+	uint16_t Fetch(uint16_t address) const { return memory[address] << 8u | memory[(address + 1) & ADDRESS_MASK]; }
+	bool WaitingForKey() const { return (Fetch(pc) & 0xF0FFu) == 0xF00Au; }
+	uint32_t IdleLoopLength() const;
+	void SkipIdle(uint32_t n);
+	void Advance(uint32_t n);
+	void TickTimers();
+	template <Backend B = DEFAULT_BACKEND>
+	void RunSteps(uint32_t n);
+	template <Backend B, unsigned Q>
+	void RunSteps(uint32_t n);
+	template <Backend B>
+	void RunStepsSkippingIdle(uint32_t n);
+	template <Backend B, unsigned Q = QUIRKS_DYNAMIC>
+	void Step();
+	template <Backend B, unsigned Q>
+	void Execute(uint8_t handler);
+	template <unsigned Q>
+	void ExecuteSwitch();
+	template <unsigned Q>
+	void ExecuteDecoded(uint8_t handler);
+	template <unsigned Q>
+	bool Quirk(unsigned bit) const { return ((Q == QUIRKS_DYNAMIC ? quirks : Q) & bit) != 0; }
+	Chip8Func Leaf(uint16_t code) const;
+	static uint8_t HandlerIndex(Chip8Func leaf);
+	DecodedOp const &Decode(uint16_t address);
+	void InvalidateDecoded(uint16_t address, uint16_t length);
+	void InvalidateDecodeCache();
+	void SkipNext();
+	void ClearPlanes();
 	void OP_NULL() {}
+	void OP_00Cn();
+	void OP_00Dn();
 	void OP_00E0();
 	void OP_00EE();
+	void OP_00FB();
+	void OP_00FC();
+	void OP_00FD();
+	void OP_00FE();
+	void OP_00FF();
 	void OP_1nnn();
 	void OP_2nnn();
 	void OP_3xkk();
 	void OP_4xkk();
 	void OP_5xy0();
+	void OP_5xy2();
+	void OP_5xy3();
 	void OP_6xkk();
 	void OP_7xkk();
 	void OP_8xy0();
@@ -164,66 +594,351 @@ public:
 	void OP_8xy3();
 	void OP_8xy4();
 	void OP_8xy5();
+	template <unsigned Q>
 	void OP_8xy6();
 	void OP_8xy7();
+	template <unsigned Q>
 	void OP_8xyE();
 	void OP_9xy0();
 	void OP_Annn();
+	template <unsigned Q>
 	void OP_Bnnn();
 	void OP_Cxkk();
+	template <unsigned Q>
 	void OP_Dxyn();
 	void OP_Ex9E();
 	void OP_ExA1();
+	void OP_F000();
+	void OP_Fn01();
+	void OP_F002();
 	void OP_Fx07();
 	void OP_Fx0A();
 	void OP_Fx15();
 	void OP_Fx18();
 	void OP_Fx1E();
 	void OP_Fx29();
+	void OP_Fx30();
 	void OP_Fx33();
+	void OP_Fx3A();
+	template <unsigned Q>
 	void OP_Fx55();
+	template <unsigned Q>
 	void OP_Fx65();
+	void OP_Fx75();
+	void OP_Fx85();
+};
+
+const Chip8::Chip8Func Chip8::HANDLERS[] = {
+	&Chip8::OP_NULL, // HANDLER_UNDECODED
+	&Chip8::OP_NULL, // HANDLER_INVALID
+#define CHIP8_HANDLER_POINTER(handler, args, name) &Chip8::handler args,
+	CHIP8_LEAF_HANDLERS(CHIP8_HANDLER_POINTER, QUIRKS_DYNAMIC)
+#undef CHIP8_HANDLER_POINTER
+};
+
+// HANDLERS[i] in the assembler-style notation used for profiles
+char const *const Chip8::HANDLER_NAMES[] = {
+	"undecoded",
+	"invalid",
+#define CHIP8_HANDLER_NAME(handler, args, name) name,
+	CHIP8_LEAF_HANDLERS(CHIP8_HANDLER_NAME, )
+#undef CHIP8_HANDLER_NAME
 };
 
-void Chip8::LoadROM(char const *filename)
+const size_t Chip8::HANDLER_COUNT = sizeof(Chip8::HANDLERS) / sizeof(Chip8::HANDLERS[0]);
+
+static_assert(sizeof(Chip8::HANDLERS) / sizeof(Chip8::HANDLERS[0]) == HANDLER_ID_COUNT,
+			  "every handler needs an id");
+
+// Load a ROM file. On error the machine is left untouched.
+RomError Chip8::LoadROM(char const *filename)
 {
-	// Open the file as a stream of binary and move the file pointer to the end
-	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	RomError error;
+	std::shared_ptr<MemoryImage const> image = LoadRomImage(filename, error);
 
-	if (file.is_open())
+	if (image)
 	{
-		// Get size of file and allocate a buffer to hold the contents
-		std::streampos size = file.tellg();
-		char *buffer = new char[size];
+		LoadImage(std::move(image));
+	}
+	return error;
+}
+
+// Start from a shared image built by BuildRomImage; memory gets a private
+// copy. predecoded, if given, is the decode cache for the image's first
+// CODE_SIZE bytes.
+void Chip8::LoadImage(std::shared_ptr<MemoryImage const> image, DecodedOp const *predecoded)
+{
+	memcpy(memory, image->data(), MEMORY_SIZE);
 
-		// Go back to the beginning of the file and fill the buffer
-		file.seekg(0, std::ios::beg);
-		file.read(buffer, size);
-		file.close();
+	// identifies the image a save state was taken against
+	loadedHash = Fnv1a(image->data(), image->size());
+	loadedImage = std::move(image);
 
-		// Load the ROM contents into the Chip8's memory, starting at 0x200
-		for (long i = 0; i < size; ++i)
+	InvalidateDecodeCache();
+
+	if (predecoded)
+	{
+		memcpy(decoded, predecoded, sizeof(decoded));
+	}
+}
+
+// The handler the dispatch tables finally call for code.
+Chip8::Chip8Func Chip8::Leaf(uint16_t code) const
+{
+	switch (code >> 12u)
+	{
+	case 0x0:
+		return Leaf0(code);
+	case 0x5:
+		return table5[code & 0x000Fu];
+	case 0x8:
+		return table8[code & 0x000Fu];
+	case 0xE:
+		return tableE[code & 0x000Fu];
+	case 0xF:
+		return tableF[code & 0x00FFu];
+	default:
+		return table[code >> 12u];
+	}
+}
+
+// Index of leaf in HANDLERS; HANDLER_INVALID for anything else.
+uint8_t Chip8::HandlerIndex(Chip8Func leaf)
+{
+	for (size_t i = HANDLER_INVALID; i < HANDLER_COUNT; i++)
+	{
+		if (HANDLERS[i] == leaf)
+		{
+			return static_cast<uint8_t>(i);
+		}
+	}
+	return HANDLER_INVALID;
+}
+
+// Resolve the leaf handler for the instruction at address < CODE_SIZE
+// through the dispatch tables and cache it.
+DecodedOp const &Chip8::Decode(uint16_t address)
+{
+	DecodedOp &op = decoded[address];
+
+	if (op.handler == HANDLER_UNDECODED)
+	{
+		op.opcode = Fetch(address);
+		op.handler = HandlerIndex(Leaf(op.opcode));
+	}
+
+	return op;
+}
+
+// Name of the handler that executes opcode, for profiles.
+char const *HandlerName(uint16_t opcode)
+{
+	static Chip8 const decoder(0);
+	return Chip8::HANDLER_NAMES[Chip8::HandlerIndex(decoder.Leaf(opcode))];
+}
+
+// A write to address changes the instructions starting at address - 1 and address.
+void Chip8::InvalidateDecoded(uint16_t address, uint16_t length)
+{
+	for (uint16_t i = 0; i <= length; i++)
+	{
+		uint16_t changed = (address + i - 1) & ADDRESS_MASK;
+		if (changed < CODE_SIZE)
 		{
-			memory[START_ADDRESS + i] = buffer[i];
+			decoded[changed].handler = HANDLER_UNDECODED;
 		}
+	}
 
-		// Free the buffer
-		delete[] buffer;
+	if (codeWriteHook)
+	{
+		codeWriteHook(codeWriteContext, address & ADDRESS_MASK, length);
+	}
+}
+
+// Call after writing memory[] from outside the core.
+void Chip8::InvalidateDecodeCache()
+{
+	memset(decoded, 0, sizeof(decoded));
+
+	if (codeWriteHook)
+	{
+		codeWriteHook(codeWriteContext, 0, CODE_SIZE);
 	}
 }
 
 void Chip8::Cycle()
 {
-	// Fetch
-	opcode = (memory[pc] << 8u | memory[pc + 1]);
-	logOP();
+	RunCycles(1);
+}
 
-	// Increment the PC before we execute anything
-	pc += 2;
+// Run n instructions, ticking the timers on every frame boundary crossed.
+template <Backend B>
+void Chip8::RunCycles(uint64_t n)
+{
+	while (n > 0)
+	{
+		uint32_t chunk = n < CyclesToFrameEnd() ? static_cast<uint32_t>(n) : CyclesToFrameEnd();
+
+		if (skipIdle)
+		{
+			RunStepsSkippingIdle<B>(chunk);
+		}
+		else
+		{
+			RunSteps<B>(chunk);
+		}
+
+		Advance(chunk);
+		n -= chunk;
+	}
+}
+
+// Run n instructions without frame accounting on the interpreter copy built
+// for the current quirks. The table backend dispatches through member
+// function pointers fixed at construction, so it always checks at run time.
+template <Backend B>
+void Chip8::RunSteps(uint32_t n)
+{
+	if constexpr (B == Backend::Table)
+	{
+		RunSteps<B, QUIRKS_DYNAMIC>(n);
+		return;
+	}
+
+	switch (quirks)
+	{
+	case PROFILE_LEGACY:
+		RunSteps<B, PROFILE_LEGACY>(n);
+		break;
+	case PROFILE_VIP:
+		RunSteps<B, PROFILE_VIP>(n);
+		break;
+	case PROFILE_CHIP48:
+		RunSteps<B, PROFILE_CHIP48>(n);
+		break;
+	case PROFILE_SCHIP:
+		RunSteps<B, PROFILE_SCHIP>(n);
+		break;
+	default:
+		RunSteps<B, QUIRKS_DYNAMIC>(n);
+		break;
+	}
+}
+
+template <Backend B, unsigned Q>
+void Chip8::RunSteps(uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++)
+	{
+		Step<B, Q>();
+	}
+}
+
+// RunSteps in slices, skipping the rest of n once an idle loop is reached.
+template <Backend B>
+void Chip8::RunStepsSkippingIdle(uint32_t n)
+{
+	while (n > 0)
+	{
+		if (IdleLoopLength())
+		{
+			SkipIdle(n);
+			return;
+		}
+
+		uint32_t slice = n < IDLE_CHECK_INTERVAL ? n : IDLE_CHECK_INTERVAL;
+		RunSteps<B>(slice);
+		n -= slice;
+	}
+}
+
+// Number of instructions in the idle loop starting at pc, or 0 if pc is not
+// at one. Nothing but the timers can end these, and the keypad only changes
+// between RunCycles calls:
+//   1nnn jumping to itself
+//   Fx0A with no key held
+//   Fx07, 3xkk, 1nnn back to the Fx07, while the delay timer is not kk
+uint32_t Chip8::IdleLoopLength() const
+{
+	uint16_t op = Fetch(pc);
+
+	// jumps only reach the first CODE_SIZE bytes
+	bool jumpable = pc < CODE_SIZE;
+
+	if (jumpable && op == (0x1000u | pc))
+	{
+		return 1;
+	}
 
-	// Decode and Execute
-	((*this).*(table[(opcode & 0xF000u) >> 12u]))();
+	if (WaitingForKey())
+	{
+		for (uint8_t key : keypad)
+		{
+			if (key)
+			{
+				return 0;
+			}
+		}
+		return 1;
+	}
+
+	if (jumpable && (op & 0xF0FFu) == 0xF007u)
+	{
+		uint16_t skip = Fetch((pc + 2) & ADDRESS_MASK);
+		uint16_t jump = Fetch((pc + 4) & ADDRESS_MASK);
+
+		if ((skip & 0xFF00u) == (0x3000u | (op & 0x0F00u)) && (skip & 0x00FFu) != delayTimer && jump == (0x1000u | pc))
+		{
+			return 3;
+		}
+	}
+
+	return 0;
+}
+
+// Account n cycles of the idle loop at pc without running them.
+void Chip8::SkipIdle(uint32_t n)
+{
+	uint32_t length = IdleLoopLength();
+
+	if (length == 3)
+	{
+		registers[(Fetch(pc) & 0x0F00u) >> 8u] = delayTimer;
+	}
+
+	// the loop's last executed instruction and where it leaves pc
+	opcode = Fetch((pc + 2 * ((n - 1) % length)) & ADDRESS_MASK);
+	pc = (pc + 2 * (n % length)) & ADDRESS_MASK;
+	idleCycles += n;
+}
+
+// Run to the end of the current frame.
+template <Backend B>
+void Chip8::RunFrame()
+{
+	RunCycles<B>(CyclesToFrameEnd());
+}
 
+// Account for n executed instructions, n <= CyclesToFrameEnd().
+void Chip8::Advance(uint32_t n)
+{
+	cycles += n;
+	frameCycle += n;
+
+	if (frameCycle >= cyclesPerFrame)
+	{
+		frameCycle = 0;
+		TickTimers();
+
+		if constexpr (ProfileSink::enabled)
+		{
+			profile.Frame();
+		}
+	}
+}
+
+void Chip8::TickTimers()
+{
 	// Decrement the delay timer if it's been set
 	if (delayTimer > 0)
 	{
@@ -236,17 +951,446 @@ void Chip8::Cycle()
 		soundTimer--;
 	}
 }
+
+template <Backend B, unsigned Q>
+void Chip8::Step()
+{
+	uint8_t handler = HANDLER_UNDECODED;
+
+	// Fetch; past CODE_SIZE the cached backend leaves HANDLER_UNDECODED and
+	// decodes through the switch
+	if (B == Backend::Cached && pc < CODE_SIZE)
+	{
+		DecodedOp const &op = decoded[pc].handler ? decoded[pc] : Decode(pc);
+		opcode = op.opcode;
+		handler = op.handler;
+	}
+	else
+	{
+		opcode = Fetch(pc);
+	}
+
+	if constexpr (ProfileSink::enabled)
+	{
+		profile.Instruction(pc, opcode);
+	}
+
+	if constexpr (TraceSink::enabled)
+	{
+		uint16_t tracePC = pc;
+		uint8_t before[16];
+		memcpy(before, registers, sizeof(registers));
+
+		pc += 2;
+		Execute<B, Q>(handler);
+
+		trace.Record(tracePC, opcode, index, before, registers);
+	}
+	else
+	{
+		// Increment the PC before we execute anything
+		pc += 2;
+
+		// Decode and Execute
+		Execute<B, Q>(handler);
+	}
+}
+
+template <Backend B, unsigned Q>
+inline void Chip8::Execute(uint8_t handler)
+{
+	if constexpr (B == Backend::Table)
+	{
+		((*this).*(table[(opcode & 0xF000u) >> 12u]))();
+	}
+	else if constexpr (B == Backend::Switch)
+	{
+		ExecuteSwitch<Q>();
+	}
+	else
+	{
+		ExecuteDecoded<Q>(handler);
+	}
+}
+
+// Cached backend: switch over the HANDLERS indices so the handlers still inline.
+template <unsigned Q>
+inline void Chip8::ExecuteDecoded(uint8_t handler)
+{
+	switch (handler)
+	{
+	case HANDLER_UNDECODED:
+		ExecuteSwitch<Q>();
+		break;
+#define CHIP8_HANDLER_CASE(handler, args, name) \
+	case HANDLER_##handler:                     \
+		handler args();                         \
+		break;
+	CHIP8_LEAF_HANDLERS(CHIP8_HANDLER_CASE, Q)
+#undef CHIP8_HANDLER_CASE
+	default: // HANDLER_INVALID
+		break;
+	}
+}
+
+// Same decoding as the dispatch tables (5, 8 and E select on the low
+// nibble, 00nn and F on the low byte) so both backends execute identical
+// instructions.
+template <unsigned Q>
+inline void Chip8::ExecuteSwitch()
+{
+	switch (opcode >> 12u)
+	{
+	case 0x0:
+		switch (opcode & 0x0FFFu)
+		{
+		case 0x0C0:
+		case 0x0C1:
+		case 0x0C2:
+		case 0x0C3:
+		case 0x0C4:
+		case 0x0C5:
+		case 0x0C6:
+		case 0x0C7:
+		case 0x0C8:
+		case 0x0C9:
+		case 0x0CA:
+		case 0x0CB:
+		case 0x0CC:
+		case 0x0CD:
+		case 0x0CE:
+		case 0x0CF:
+			OP_00Cn();
+			break;
+		case 0x0D0:
+		case 0x0D1:
+		case 0x0D2:
+		case 0x0D3:
+		case 0x0D4:
+		case 0x0D5:
+		case 0x0D6:
+		case 0x0D7:
+		case 0x0D8:
+		case 0x0D9:
+		case 0x0DA:
+		case 0x0DB:
+		case 0x0DC:
+		case 0x0DD:
+		case 0x0DE:
+		case 0x0DF:
+			OP_00Dn();
+			break;
+		case 0x0E0:
+			OP_00E0();
+			break;
+		case 0x0EE:
+			OP_00EE();
+			break;
+		case 0x0FB:
+			OP_00FB();
+			break;
+		case 0x0FC:
+			OP_00FC();
+			break;
+		case 0x0FD:
+			OP_00FD();
+			break;
+		case 0x0FE:
+			OP_00FE();
+			break;
+		case 0x0FF:
+			OP_00FF();
+			break;
+		}
+		break;
+	case 0x1:
+		OP_1nnn();
+		break;
+	case 0x2:
+		OP_2nnn();
+		break;
+	case 0x3:
+		OP_3xkk();
+		break;
+	case 0x4:
+		OP_4xkk();
+		break;
+	case 0x5:
+		switch (opcode & 0x000Fu)
+		{
+		case 0x0:
+			OP_5xy0();
+			break;
+		case 0x2:
+			OP_5xy2();
+			break;
+		case 0x3:
+			OP_5xy3();
+			break;
+		}
+		break;
+	case 0x6:
+		OP_6xkk();
+		break;
+	case 0x7:
+		OP_7xkk();
+		break;
+	case 0x8:
+		switch (opcode & 0x000Fu)
+		{
+		case 0x0:
+			OP_8xy0();
+			break;
+		case 0x1:
+			OP_8xy1();
+			break;
+		case 0x2:
+			OP_8xy2();
+			break;
+		case 0x3:
+			OP_8xy3();
+			break;
+		case 0x4:
+			OP_8xy4();
+			break;
+		case 0x5:
+			OP_8xy5();
+			break;
+		case 0x6:
+			OP_8xy6<Q>();
+			break;
+		case 0x7:
+			OP_8xy7();
+			break;
+		case 0xE:
+			OP_8xyE<Q>();
+			break;
+		}
+		break;
+	case 0x9:
+		OP_9xy0();
+		break;
+	case 0xA:
+		OP_Annn();
+		break;
+	case 0xB:
+		OP_Bnnn<Q>();
+		break;
+	case 0xC:
+		OP_Cxkk();
+		break;
+	case 0xD:
+		OP_Dxyn<Q>();
+		break;
+	case 0xE:
+		switch (opcode & 0x000Fu)
+		{
+		case 0x1:
+			OP_ExA1();
+			break;
+		case 0xE:
+			OP_Ex9E();
+			break;
+		}
+		break;
+	case 0xF:
+		switch (opcode & 0x00FFu)
+		{
+		case 0x00:
+			OP_F000();
+			break;
+		case 0x01:
+			OP_Fn01();
+			break;
+		case 0x02:
+			OP_F002();
+			break;
+		case 0x07:
+			OP_Fx07();
+			break;
+		case 0x0A:
+			OP_Fx0A();
+			break;
+		case 0x15:
+			OP_Fx15();
+			break;
+		case 0x18:
+			OP_Fx18();
+			break;
+		case 0x1E:
+			OP_Fx1E();
+			break;
+		case 0x29:
+			OP_Fx29();
+			break;
+		case 0x30:
+			OP_Fx30();
+			break;
+		case 0x33:
+			OP_Fx33();
+			break;
+		case 0x3A:
+			OP_Fx3A();
+			break;
+		case 0x55:
+			OP_Fx55<Q>();
+			break;
+		case 0x65:
+			OP_Fx65<Q>();
+			break;
+		case 0x75:
+			OP_Fx75();
+			break;
+		case 0x85:
+			OP_Fx85();
+			break;
+		}
+		break;
+	}
+}
+
+// Skip the next instruction, which is four bytes long if it is XO-CHIP's F000 nnnn.
+inline void Chip8::SkipNext()
+{
+	pc += Fetch(pc) == 0xF000u ? 4 : 2;
+}
+
+void Chip8::ClearPlanes()
+{
+	for (unsigned plane = 0; plane < PLANES; plane++)
+	{
+		if (planes & (1u << plane))
+		{
+			memset(screen[plane], 0, sizeof(screen[plane]));
+		}
+	}
+	screenDirty = true;
+}
+
+void Chip8::OP_00Cn()
+// SCD nibble
+// Scroll the selected planes down n rows; a row is a run of words, so this is a memmove.
+{
+	unsigned words = ScreenWords();
+	unsigned shift = (opcode & 0x000Fu) * words;
+	unsigned total = ScreenHeight() * words;
+
+	for (unsigned plane = 0; plane < PLANES; plane++)
+	{
+		if (planes & (1u << plane))
+		{
+			memmove(screen[plane] + shift, screen[plane], (total - shift) * sizeof(uint64_t));
+			memset(screen[plane], 0, shift * sizeof(uint64_t));
+		}
+	}
+	screenDirty = true;
+}
+
+void Chip8::OP_00Dn()
+// SCU nibble (XO-CHIP)
+// Scroll the selected planes up n rows.
+{
+	unsigned words = ScreenWords();
+	unsigned shift = (opcode & 0x000Fu) * words;
+	unsigned total = ScreenHeight() * words;
+
+	for (unsigned plane = 0; plane < PLANES; plane++)
+	{
+		if (planes & (1u << plane))
+		{
+			memmove(screen[plane], screen[plane] + shift, (total - shift) * sizeof(uint64_t));
+			memset(screen[plane] + total - shift, 0, shift * sizeof(uint64_t));
+		}
+	}
+	screenDirty = true;
+}
+
 void Chip8::OP_00E0()
-// clear screen
+// clear screen (the selected planes)
 {
-	memset(screen, 0, sizeof(screen));
+	ClearPlanes();
 }
 
 void Chip8::OP_00EE()
 // RET
 {
 	--sp;
-	pc = stack[sp];
+	pc = stack[sp & 0xFu];
+}
+
+void Chip8::OP_00FB()
+// SCR
+// Scroll the selected planes right 4 pixels, carrying bits between the words of a row.
+{
+	unsigned words = ScreenWords();
+	unsigned total = ScreenHeight() * words;
+
+	for (unsigned plane = 0; plane < PLANES; plane++)
+	{
+		if (planes & (1u << plane))
+		{
+			for (unsigned row = 0; row < total; row += words)
+			{
+				uint64_t *line = screen[plane] + row;
+				for (unsigned w = words - 1; w > 0; w--)
+				{
+					line[w] = line[w] >> 4u | line[w - 1] << 60u;
+				}
+				line[0] >>= 4u;
+			}
+		}
+	}
+	screenDirty = true;
+}
+
+void Chip8::OP_00FC()
+// SCL
+// Scroll the selected planes left 4 pixels.
+{
+	unsigned words = ScreenWords();
+	unsigned total = ScreenHeight() * words;
+
+	for (unsigned plane = 0; plane < PLANES; plane++)
+	{
+		if (planes & (1u << plane))
+		{
+			for (unsigned row = 0; row < total; row += words)
+			{
+				uint64_t *line = screen[plane] + row;
+				for (unsigned w = 0; w + 1 < words; w++)
+				{
+					line[w] = line[w] << 4u | line[w + 1] >> 60u;
+				}
+				line[words - 1] <<= 4u;
+			}
+		}
+	}
+	screenDirty = true;
+}
+
+void Chip8::OP_00FD()
+// EXIT
+// Stop the program: it stays on this instruction.
+{
+	pc -= 2;
+}
+
+void Chip8::OP_00FE()
+// LOW
+// Switch to SCREEN_WIDTH x SCREEN_HEIGHT and clear every plane.
+{
+	hires = false;
+	memset(screen, 0, sizeof(screen));
+	screenDirty = true;
+}
+
+void Chip8::OP_00FF()
+// HIGH
+// Switch to HIRES_WIDTH x HIRES_HEIGHT and clear every plane.
+{
+	hires = true;
+	memset(screen, 0, sizeof(screen));
+	screenDirty = true;
 }
 
 void Chip8::OP_1nnn()
@@ -259,7 +1403,7 @@ void Chip8::OP_1nnn()
 void Chip8::OP_2nnn()
 // CALL at @nnn
 {
-	stack[sp] = pc;
+	stack[sp & 0xFu] = pc;
 	sp++;
 
 	uint16_t address = opcode & 0XFFFu;
@@ -273,7 +1417,7 @@ void Chip8::OP_3xkk()
 	uint8_t value = (opcode & 0x00FFu);
 	if (registers[Vx] == value)
 	{
-		pc += 2;
+		SkipNext();
 	}
 }
 
@@ -284,7 +1428,7 @@ void Chip8::OP_4xkk()
 	uint8_t value = (opcode & 0x00FFu);
 	if (registers[Vx] != value)
 	{
-		pc += 2;
+		SkipNext();
 	}
 }
 
@@ -295,7 +1439,37 @@ void Chip8::OP_5xy0()
 	uint8_t Vy = (opcode & 0x00F0u) >> 4u;
 	if (registers[Vx] == registers[Vy])
 	{
-		pc += 2;
+		SkipNext();
+	}
+}
+
+void Chip8::OP_5xy2()
+// SAVE Vx - Vy (XO-CHIP)
+// Store Vx through Vy, in either order, in memory starting at location I; I is unchanged.
+{
+	uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+	uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+	uint8_t count = (Vx <= Vy ? Vy - Vx : Vx - Vy) + 1;
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		memory[(index + i) & ADDRESS_MASK] = registers[Vx <= Vy ? Vx + i : Vx - i];
+	}
+
+	InvalidateDecoded(index, count);
+}
+
+void Chip8::OP_5xy3()
+// LOAD Vx - Vy (XO-CHIP)
+// Read Vx through Vy, in either order, from memory starting at location I; I is unchanged.
+{
+	uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+	uint8_t Vy = (opcode & 0x00F0u) >> 4u;
+	uint8_t count = (Vx <= Vy ? Vy - Vx : Vx - Vy) + 1;
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		registers[Vx <= Vy ? Vx + i : Vx - i] = memory[(index + i) & ADDRESS_MASK];
 	}
 }
 
@@ -375,13 +1549,15 @@ void Chip8::OP_8xy5()
 	registers[Vx] -= registers[Vy];
 }
 
+template <unsigned Q>
 void Chip8::OP_8xy6()
 // SHR Vx with lost bit in VF
 {
 	uint8_t Vx = (opcode & 0x0F00u) >> 8u;
+	uint8_t Vs = Quirk<Q>(QUIRK_SHIFT_VY) ? (opcode & 0x00F0u) >> 4u : Vx;
 
-	registers[0xF] = registers[Vx] & 0x1u;
-	registers[Vx] >>= 1;
+	registers[0xF] = registers[Vs] & 0x1u;
+	registers[Vx] = registers[Vs] >> 1;
 }
 
 void Chip8::OP_8xy7()
@@ -396,13 +1572,15 @@ void Chip8::OP_8xy7()
 	registers[Vx] = registers[Vy] - registers[Vx];
 }
 
+template <unsigned Q>
 void Chip8::OP_8xyE()
 // SHL Vx with lost bit in VF
 {
 	uint8_t Vx = (opcode & 0x0F00u) >> 8u;
-	registers[0xF] = (registers[Vx] & 0x80) >> 7u;
+	uint8_t Vs = Quirk<Q>(QUIRK_SHIFT_VY) ? (opcode & 0x00F0u) >> 4u : Vx;
+	registers[0xF] = (registers[Vs] & 0x80) >> 7u;
 
-	registers[Vx] <<= 1;
+	registers[Vx] = registers[Vs] << 1;
 }
 
 void Chip8::OP_9xy0()
@@ -412,7 +1590,7 @@ void Chip8::OP_9xy0()
 	uint8_t Vy = (opcode & 0x00F0u) >> 4u;
 	if (registers[Vx] != registers[Vy])
 	{
-		pc += 2;
+		SkipNext();
 	}
 }
 
@@ -423,12 +1601,14 @@ void Chip8::OP_Annn()
 	index = address;
 }
 
+template <unsigned Q>
 void Chip8::OP_Bnnn()
 // Bnnn - JP V0, addr
-// Jump to location nnn + V0.
+// Jump to location nnn + V0, or xnn + Vx with QUIRK_JUMP_VX.
 {
 	uint16_t address = opcode & 0x0FFFu;
-	pc = registers[0] + address;
+	uint8_t Vj = Quirk<Q>(QUIRK_JUMP_VX) ? (opcode & 0x0F00u) >> 8u : 0;
+	pc = registers[Vj] + address;
 }
 void Chip8::OP_Cxkk()
 // Cxkk - RND Vx, byte
@@ -437,45 +1617,80 @@ void Chip8::OP_Cxkk()
 	uint8_t value = opcode & 0x00FFu;
 	uint8_t Vx = (opcode & 0x0F00u) >> 8u;
 
-	registers[Vx] = randByte(randGen) & value;
+	registers[Vx] = randGen.NextByte() & value;
 }
 
+template <unsigned Q>
 void Chip8::OP_Dxyn()
 // DRW Vx, Vy, nibble
 
 // Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
+// Dxy0 draws a 16x16 sprite of two bytes per row. Every selected plane draws
+// its own sprite, taken from memory one after the other.
 {
 	uint8_t Vx = (opcode & 0x0F00u) >> 8u;
 	uint8_t Vy = (opcode & 0x00F0u) >> 4u;
 	uint8_t height = opcode & 0x000Fu;
+	bool wide = height == 0;
+	uint8_t spriteBytes = wide ? 32 : height;
 
-	uint8_t xPos = registers[Vx] % SCREEN_WIDTH;
-	uint8_t yPos = registers[Vy] % SCREEN_HEIGHT;
+	unsigned width = ScreenWidth();
+	unsigned words = ScreenWords();
+	unsigned xPos = registers[Vx] % width;
+	unsigned yPos = registers[Vy] % ScreenHeight();
 
 	registers[0xF] = 0; // if no collision happens VF stays 0
+	screenDirty = true;
+
+	height = wide ? 16 : height;
 
-	uint8_t mask = 0x80;
+	// when clipping, rows below the bottom edge are not drawn
+	if (Quirk<Q>(QUIRK_CLIP) && yPos + height > ScreenHeight())
+	{
+		height = ScreenHeight() - yPos;
+	}
+
+	// A sprite row lands in two words at most: from bit xPos % 64 of word
+	// xPos / 64 on, then in the next word, which past the right edge wraps
+	// around to word 0 or, when clipping, drops off (second == words).
+	unsigned first = xPos / 64u;
+	unsigned shift = xPos % 64u;
+	unsigned second = first + 1 < words ? first + 1 : Quirk<Q>(QUIRK_CLIP) ? words : 0;
+	uint16_t address = index;
 
-	for (uint8_t row = 0; row < height; row++)
+	for (unsigned plane = 0; plane < PLANES; plane++)
 	{
-		for (uint8_t col = 0; col < 8; col++)
+		if (!(planes & (1u << plane)))
+		{
+			continue;
+		}
+
+		for (uint8_t row = 0; row < height; row++)
 		{
-			uint8_t spritePixel = memory[index + row] & (mask >> col);
+			uint64_t sprite = wide ? static_cast<uint64_t>(memory[(address + 2 * row) & ADDRESS_MASK] << 8u | memory[(address + 2 * row + 1) & ADDRESS_MASK]) << 48u
+								   : static_cast<uint64_t>(memory[(address + row) & ADDRESS_MASK]) << 56u;
+			uint64_t left = sprite >> shift;
+			uint64_t right = shift ? sprite << (64u - shift) : 0;
 
-			uint16_t x = (xPos + col) % SCREEN_WIDTH;
-			uint16_t y = (yPos + row) % SCREEN_HEIGHT;
-			uint16_t screenPixelPosition = y * SCREEN_WIDTH + x;
+			uint64_t *line = screen[plane] + (yPos + row) % ScreenHeight() * words;
 
-			if (!registers[0xF] && screen[screenPixelPosition] && spritePixel)
+			if (line[first] & left)
 			{
 				registers[0xF] = 1;
 			}
-			if (spritePixel)
+			line[first] ^= left;
+
+			if (second < words)
 			{
-				screen[screenPixelPosition] ^= 0xFFFFFFFF;
+				if (line[second] & right)
+				{
+					registers[0xF] = 1;
+				}
+				line[second] ^= right;
 			}
-			// else XOR with 0;
 		}
+
+		address += spriteBytes;
 	}
 }
 
@@ -485,11 +1700,11 @@ void Chip8::OP_Ex9E()
 {
 	uint8_t Vx = (opcode & 0x0F00u) >> 8u;
 
-	uint8_t key = registers[Vx];
+	uint8_t key = registers[Vx] & 0xFu;
 
 	if (keypad[key])
 	{
-		pc += 2;
+		SkipNext();
 	}
 }
 
@@ -499,11 +1714,36 @@ void Chip8::OP_ExA1()
 {
 	uint8_t Vx = (opcode & 0x0F00u) >> 8u;
 
-	uint8_t key = registers[Vx];
+	uint8_t key = registers[Vx] & 0xFu;
 
 	if (!keypad[key])
 	{
-		pc += 2;
+		SkipNext();
+	}
+}
+
+void Chip8::OP_F000()
+// LD I, nnnn (XO-CHIP)
+// Set I to the word that follows the instruction, and step over it.
+{
+	index = Fetch(pc);
+	pc += 2;
+}
+
+void Chip8::OP_Fn01()
+// PLANE n (XO-CHIP)
+// Select the bit-planes that drawing, clearing and scrolling act on.
+{
+	planes = (opcode & 0x0F00u) >> 8u & ((1u << PLANES) - 1);
+}
+
+void Chip8::OP_F002()
+// AUDIO (XO-CHIP)
+// Load the 16-byte sample loop from memory starting at location I.
+{
+	for (uint8_t i = 0; i < sizeof(audioPattern); i++)
+	{
+		audioPattern[i] = memory[(index + i) & ADDRESS_MASK];
 	}
 }
 
@@ -625,6 +1865,15 @@ void Chip8::OP_Fx29()
 	index = FONTSET_START_ADDRESS + (5 * registers[Vx]);
 }
 
+void Chip8::OP_Fx30()
+// LD HF, Vx
+// Set I = location of the 8x10 sprite for digit Vx.
+{
+	uint8_t Vx = (opcode & 0x0F00u) >> 8;
+
+	index = BIG_FONTSET_START_ADDRESS + (10 * (registers[Vx] & 0xFu));
+}
+
 void Chip8::OP_Fx33()
 // LD B, Vx
 // Store BCD representation of Vx in memory locations I, I+1, and I+2.
@@ -635,11 +1884,22 @@ void Chip8::OP_Fx33()
 	uint8_t tens = (registers[Vx] / 10) % 10;
 	uint8_t units = registers[Vx] % 10;
 
-	memory[index] = hundreds;
-	memory[index + 1] = tens;
-	memory[index + 2] = units;
+	memory[index & ADDRESS_MASK] = hundreds;
+	memory[(index + 1) & ADDRESS_MASK] = tens;
+	memory[(index + 2) & ADDRESS_MASK] = units;
+
+	InvalidateDecoded(index, 3);
+}
+
+void Chip8::OP_Fx3A()
+// PITCH Vx (XO-CHIP)
+{
+	uint8_t Vx = (opcode & 0x0F00u) >> 8;
+
+	pitch = registers[Vx];
 }
 
+template <unsigned Q>
 void Chip8::OP_Fx55()
 // LD [I], Vx
 // Store registers V0 through Vx in memory starting at location I.
@@ -648,10 +1908,22 @@ void Chip8::OP_Fx55()
 
 	for (uint8_t i = 0; i <= Vx; i++)
 	{
-		memory[index + i] = registers[i];
+		memory[(index + i) & ADDRESS_MASK] = registers[i];
+	}
+
+	InvalidateDecoded(index, Vx + 1);
+
+	if (Quirk<Q>(QUIRK_LOAD_STORE_I))
+	{
+		index += Vx + 1;
+	}
+	else if (Quirk<Q>(QUIRK_LOAD_STORE_X))
+	{
+		index += Vx;
 	}
 }
 
+template <unsigned Q>
 void Chip8::OP_Fx65()
 // LD Vx, [I]
 // Read registers V0 through Vx from memory starting at location I.
@@ -660,12 +1932,39 @@ void Chip8::OP_Fx65()
 
 	for (uint8_t i = 0; i <= Vx; i++)
 	{
-		registers[i] = memory[index + i];
+		registers[i] = memory[(index + i) & ADDRESS_MASK];
+	}
+
+	if (Quirk<Q>(QUIRK_LOAD_STORE_I))
+	{
+		index += Vx + 1;
+	}
+	else if (Quirk<Q>(QUIRK_LOAD_STORE_X))
+	{
+		index += Vx;
 	}
 }
 
-void Chip8::logOP()
+void Chip8::OP_Fx75()
+// LD R, Vx
+// Store registers V0 through Vx in the user flags.
 {
+	uint8_t Vx = (opcode & 0x0F00u) >> 8;
+
+	for (uint8_t i = 0; i <= Vx; i++)
+	{
+		flags[i] = registers[i];
+	}
+}
 
-	std::cout << std::hex << pc - 2 << ": " << std::hex << opcode << std::endl;
+void Chip8::OP_Fx85()
+// LD Vx, R
+// Read registers V0 through Vx from the user flags.
+{
+	uint8_t Vx = (opcode & 0x0F00u) >> 8;
+
+	for (uint8_t i = 0; i <= Vx; i++)
+	{
+		registers[i] = flags[i];
+	}
 }
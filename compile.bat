@@ -1 +1,2 @@
-g++ -I src/include -L src/lib -o main main.cpp -lmingw32  -lSDL3
\ No newline at end of file
+g++ -I src/include -L src/lib -o main main.cpp -lmingw32  -lSDL3
+g++ -O2 -o headless headless.cpp
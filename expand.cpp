@@ -0,0 +1,142 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+// Expansion of the 1-bit framebuffer into a palettized, integer-scaled RGBA
+// image, written straight into the destination (e.g. locked texture memory).
+//
+// Rows are packed as in Chip8::screen: (width + 63) / 64 words per row, bit
+// 63 of the first word is the leftmost pixel. Each source row is expanded
+// once into the first of its `scale` destination rows, which are then
+// duplicated with memcpy. The SSE2 path builds the scaled row from broadcast
+// colour vectors. The row copies, bound by memory bandwidth, take most of the
+// time at the usual scales, so a wider (AVX2) path gains nothing.
+
+// SSE2 intrinsics only compile where the target guarantees SSE2 (x86-64, or
+// i386 built with -msse2).
+#if defined(__SSE2__) || defined(_M_X64)
+#define CHIP8_EXPAND_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef void (*ExpandFunc)(uint64_t const *rows, int width, int height, int scale,
+						   uint32_t off, uint32_t on, void *out, int pitch);
+
+inline bool PixelSet(uint64_t const *row, int x)
+{
+	return (row[x >> 6] >> (63 - (x & 63))) & 1u;
+}
+
+inline void DuplicateRows(uint8_t *first, int rowBytes, int scale, int pitch)
+{
+	for (int i = 1; i < scale; i++)
+	{
+		memcpy(first + i * pitch, first, rowBytes);
+	}
+}
+
+void ExpandScalar(uint64_t const *rows, int width, int height, int scale,
+				  uint32_t off, uint32_t on, void *out, int pitch)
+{
+	int words = (width + 63) / 64;
+
+	for (int y = 0; y < height; y++)
+	{
+		uint8_t *line = static_cast<uint8_t *>(out) + y * scale * pitch;
+		uint32_t *pixel = reinterpret_cast<uint32_t *>(line);
+
+		for (int x = 0; x < width; x++)
+		{
+			uint32_t color = PixelSet(rows + y * words, x) ? on : off;
+
+			for (int k = 0; k < scale; k++)
+			{
+				*pixel++ = color;
+			}
+		}
+
+		DuplicateRows(line, width * scale * 4, scale, pitch);
+	}
+}
+
+#ifdef CHIP8_EXPAND_SIMD
+
+void ExpandSSE2(uint64_t const *rows, int width, int height, int scale,
+				uint32_t off, uint32_t on, void *out, int pitch)
+{
+	int words = (width + 63) / 64;
+	__m128i const offV = _mm_set1_epi32(off);
+	__m128i const diffV = _mm_set1_epi32(off ^ on);
+
+	for (int y = 0; y < height; y++)
+	{
+		uint8_t *line = static_cast<uint8_t *>(out) + y * scale * pitch;
+		uint32_t *pixel = reinterpret_cast<uint32_t *>(line);
+
+		for (int x = 0; x < width; x++)
+		{
+			// all-ones when the pixel is set, selects on via off ^ (on ^ off)
+			__m128i mask = _mm_set1_epi32(-static_cast<int32_t>(PixelSet(rows + y * words, x)));
+			__m128i color = _mm_xor_si128(offV, _mm_and_si128(mask, diffV));
+
+			int k = 0;
+			for (; k + 4 <= scale; k += 4)
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(pixel + k), color);
+			}
+			for (; k < scale; k++)
+			{
+				pixel[k] = static_cast<uint32_t>(_mm_cvtsi128_si32(color));
+			}
+
+			pixel += scale;
+		}
+
+		DuplicateRows(line, width * scale * 4, scale, pitch);
+	}
+}
+
+#endif
+
+inline ExpandFunc BestExpand()
+{
+#ifdef CHIP8_EXPAND_SIMD
+	return &ExpandSSE2;
+#else
+	return &ExpandScalar;
+#endif
+}
+
+inline void ExpandFramebuffer(uint64_t const *rows, int width, int height, int scale,
+							  uint32_t off, uint32_t on, void *out, int pitch)
+{
+	static ExpandFunc const expand = BestExpand();
+	expand(rows, width, height, scale, off, on, out, pitch);
+}
+
+// Two bit-planes (XO-CHIP) through a four colour palette: each pixel takes
+// colours[plane0 | plane1 << 1]. Only used while the second plane has pixels
+// set, so it stays scalar.
+void ExpandPlanes(uint64_t const *plane0, uint64_t const *plane1, int width, int height, int scale,
+				  uint32_t const colours[4], void *out, int pitch)
+{
+	int words = (width + 63) / 64;
+
+	for (int y = 0; y < height; y++)
+	{
+		uint8_t *line = static_cast<uint8_t *>(out) + y * scale * pitch;
+		uint32_t *pixel = reinterpret_cast<uint32_t *>(line);
+
+		for (int x = 0; x < width; x++)
+		{
+			uint32_t color = colours[PixelSet(plane0 + y * words, x) | PixelSet(plane1 + y * words, x) << 1];
+
+			for (int k = 0; k < scale; k++)
+			{
+				*pixel++ = color;
+			}
+		}
+
+		DuplicateRows(line, width * scale * 4, scale, pitch);
+	}
+}
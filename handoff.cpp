@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include "chip8.cpp"
+
+// Hand-off between main's emulation thread and its SDL thread.
+//
+// Frames travel through a TripleBuffer: the emulation thread fills the back
+// slot and swaps it with the middle one, and the SDL thread swaps the middle
+// slot to the front whenever a newer frame is there. Neither side ever waits
+// for the other, so a present blocked on the display cannot stall emulation,
+// and the SDL thread always shows the newest complete frame. Input travels
+// the other way through input.cpp.
+
+template <typename T>
+class TripleBuffer
+{
+public:
+	// Emulation side: fill Back(), then Publish() it.
+	T &Back() { return slots[back]; }
+
+	void Publish()
+	{
+		back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	// SDL side: take the newest published frame as Front(), if there is one
+	// it has not seen. Returns false if Front() is unchanged.
+	bool Acquire()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & FRESH))
+		{
+			return false;
+		}
+
+		front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+
+	T const &Front() const { return slots[front]; }
+
+private:
+	static constexpr uint8_t INDEX = 3;
+	static constexpr uint8_t FRESH = 4; // set in middle by Publish, cleared by Acquire
+
+	T slots[3];
+	uint8_t back = 0;
+	std::atomic<uint8_t> middle{1};
+	uint8_t front = 2;
+};
+
+struct VideoFrame
+{
+	uint64_t screen[PLANES][PLANE_WORDS] = {};
+	unsigned width = SCREEN_WIDTH;
+	unsigned height = SCREEN_HEIGHT;
+	uint64_t generation = 0; // changes whenever the screen does
+	uint64_t cycles = 0;	 // instructions run forward (not rewound) so far
+	uint64_t idleCycles = 0; // Chip8::idleCycles
+	std::vector<uint64_t> heatmap; // profile builds, while the overlay is shown
+};
@@ -0,0 +1,1052 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <filesystem>
+#include "chip8.cpp"
+#include "jit.cpp"
+#include "expand.cpp"
+#include "savestate.cpp"
+#include "rewind.cpp"
+#include "movie.cpp"
+#include "runner.cpp"
+#include "lockstep.cpp"
+#include "registry.cpp"
+#include "runahead.cpp"
+#include "netplay.cpp"
+
+// Headless driver: runs the core without SDL so throughput can be measured.
+//
+// Usage: headless [-n <millions>] [-s <seed>] [-k <keyscript>] [-p <profile>] [-i] [ROM or dir ...]
+//        headless -x
+//        headless -r <movie> <ROM>
+//        headless -f <instances> [-t <threads>] [-n <millions>] [-s <seed>] [-i] [ROM or dir ...]
+//        headless -l <lanes> [-n <millions>] [-s <seed>] [ROM or dir ...]
+//        headless -net <player> <local port> <remote port> [-latency <ms>] [-loss <percent>] [-frames <count>] [-s <seed>] <ROM>
+//
+// Every ROM (or every file in a given directory, default tests/) is run for
+// N million cycles on each dispatch backend (and the x86-64 recompiler where
+// available) and one JSON object per ROM is written to stdout. The final
+// machine states are compared against the table backend and reported as
+// "match"; the exit status is non-zero on any mismatch. Save states are
+// checked too: a restored machine must replay to the same state, and the
+// save/load rates and snapshot size are reported. Ten minutes of frames are
+// recorded into a rewind history and sampled frames are sought back and
+// compared against save states taken at the time, and a session rewound
+// while a key is held must replay from the movie recorded of it. Ten seconds
+// run with two frames of run-ahead after every frame report its cost per
+// frame and must end where a machine without it does.
+//
+// -x benchmarks the framebuffer expansion paths of expand.cpp at scales 10-20
+// instead.
+//
+// -r replays a movie recorded by main (see movie.cpp) at full speed on the
+// cached interpreter and the recompiler, and checks both reach the recorded
+// final state. The exit status is non-zero if either does not.
+//
+// -f runs a fleet of instances (cycling through the ROMs, seeded seed + i)
+// for N million cycles each, in whole frames at each ROM's instructions per
+// frame, through the work-stealing runner of runner.cpp, once on one thread
+// and once on -t threads (default all cores), and reports the aggregate
+// throughput of both and each instance's frames and final state hash, which
+// must agree between the two runs. Instances are fed key input through the
+// fleet's frame hook, and the last one is checked against a run on its own.
+//
+// -l runs each ROM as that many lanes of the lockstep engine (lockstep.cpp),
+// all with the same seed but different key input, for N million cycles per
+// lane (whole frames at the ROM's instructions per frame), then runs every
+// lane again on its own Chip8 and checks the final states are identical.
+// Reports both throughputs and how often lanes diverged from vector execution.
+//
+// -net runs player 0 or 1 of a rollback netplay session (netplay.cpp) with
+// the other player's process on localhost, for -frames frames (default 1800,
+// half a minute) at 60 a second, each player pressing lane keys of its own. Outgoing packets can
+// be delayed and dropped to simulate a network. Reports the rollbacks,
+// re-simulated frames and time, stalls and desyncs, and checks the final
+// state against a local run with both players' keys.
+//
+// ROMs are loaded through the registry of registry.cpp, so settings from the
+// ROM database ($CHIP8_ROM_DB or romdb.txt) apply here too. -p <profile>
+// (legacy, vip, chip48, schip) runs every machine with that profile's quirks
+// instead, in any mode.
+//
+// -i lets every machine skip idle loops (Chip8::skipIdle) straight to the next
+// timer tick. The table backend still runs every instruction, so "match"
+// checks that skipping changes nothing, and each ROM reports the fraction of
+// its cycles the cached backend skipped as "idle". Fleets report it per
+// instance and overall.
+//
+// A key script is a text file of "<cycle> <key> <0|1>" lines (key in hex),
+// applied to the keypad when the cycle count is reached. Without one the
+// keypad stays released.
+
+struct KeyEvent
+{
+    uint64_t cycle;
+    uint8_t key;
+    uint8_t down;
+};
+
+struct RunResult
+{
+    uint64_t cycles;
+    double seconds[4];
+    uint64_t classCounts[16];
+    bool match;
+    size_t snapshotBytes;
+    double savesPerSecond;
+    double loadsPerSecond;
+    size_t rewindBytes;
+    double seekMicroseconds;
+    double runAheadMicroseconds;
+    double idleFraction;
+};
+
+static const char *const ENGINE_NAMES[4] = {"table", "switch", "cached", "jit"};
+
+#ifdef CHIP8_JIT
+static const int ENGINE_COUNT = 4;
+#else
+static const int ENGINE_COUNT = 3;
+#endif
+
+static const char *const OPCODE_CLASSES[16] = {
+    "0nnn", "1nnn", "2nnn", "3xkk", "4xkk", "5xy0", "6xkk", "7xkk",
+    "8xyn", "9xy0", "Annn", "Bnnn", "Cxkk", "Dxyn", "Exkk", "Fxkk"};
+
+static std::vector<KeyEvent> LoadKeyScript(char const *filename)
+{
+    std::vector<KeyEvent> events;
+    std::ifstream file(filename);
+
+    if (!file.is_open())
+    {
+        std::cerr << "cannot open key script " << filename << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream in(line);
+        uint64_t cycle;
+        unsigned int key, down;
+
+        if (in >> std::dec >> cycle >> std::hex >> key >> std::dec >> down)
+        {
+            events.push_back({cycle, static_cast<uint8_t>(key & 0xFu), static_cast<uint8_t>(down ? 1 : 0)});
+        }
+    }
+
+    std::stable_sort(events.begin(), events.end(), [](KeyEvent const &a, KeyEvent const &b)
+                     { return a.cycle < b.cycle; });
+    return events;
+}
+
+// Run cycles in chunks between key events so the timed loop stays tight.
+template <typename Runner>
+static void RunScript(Chip8 &chip8, uint64_t cycles, std::vector<KeyEvent> const &script, Runner &&run)
+{
+    size_t next = 0;
+    uint64_t done = 0;
+
+    while (done < cycles)
+    {
+        while (next < script.size() && script[next].cycle <= done)
+        {
+            chip8.keypad[script[next].key] = script[next].down;
+            next++;
+        }
+
+        uint64_t end = next < script.size() ? std::min(cycles, script[next].cycle) : cycles;
+
+        run(end - done);
+        done = end;
+    }
+}
+
+static bool SameState(Chip8 const &a, Chip8 const &b)
+{
+    return memcmp(a.registers, b.registers, sizeof(a.registers)) == 0 &&
+           memcmp(a.memory, b.memory, sizeof(a.memory)) == 0 &&
+           memcmp(a.stack, b.stack, sizeof(a.stack)) == 0 &&
+           memcmp(a.screen, b.screen, sizeof(a.screen)) == 0 &&
+           memcmp(a.flags, b.flags, sizeof(a.flags)) == 0 &&
+           a.hires == b.hires && a.planes == b.planes &&
+           a.pc == b.pc && a.index == b.index && a.sp == b.sp &&
+           a.delayTimer == b.delayTimer && a.soundTimer == b.soundTimer && a.opcode == b.opcode;
+}
+
+// ROMs are read and decoded once, then every machine loads them from here
+static RomRegistry registry;
+
+// -p replaces the quirks from the database for every machine
+static char const *profileName = nullptr;
+static unsigned profileQuirks = PROFILE_LEGACY;
+
+// -i sets skipIdle on every machine
+static bool skipIdle = false;
+
+static void LoadMachine(Chip8 &chip8, char const *filename)
+{
+    RomError error = registry.Load(chip8, filename);
+    if (error != RomError::None)
+    {
+        std::cerr << filename << ": " << RomErrorString(error) << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (profileName)
+    {
+        chip8.quirks = profileQuirks;
+    }
+
+    chip8.skipIdle = skipIdle;
+}
+
+static std::unique_ptr<Chip8> NewMachine(char const *filename, unsigned int seed)
+{
+    auto chip8 = std::make_unique<Chip8>(seed);
+    LoadMachine(*chip8, filename);
+    return chip8;
+}
+
+template <typename Runner>
+static double TimeScript(Chip8 &chip8, uint64_t cycles, std::vector<KeyEvent> const &script, Runner &&run)
+{
+    auto start = std::chrono::steady_clock::now();
+    RunScript(chip8, cycles, script, run);
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double>(end - start).count();
+}
+
+template <Backend B>
+static std::unique_ptr<Chip8> TimeBackend(char const *filename, uint64_t cycles, unsigned int seed, std::vector<KeyEvent> const &script, RunResult &result)
+{
+    auto chip8 = NewMachine(filename, seed);
+    Chip8 &machine = *chip8;
+
+    // the reference for "match" runs every instruction
+    if (B == Backend::Table)
+    {
+        machine.skipIdle = false;
+    }
+
+    result.seconds[static_cast<int>(B)] = TimeScript(machine, cycles, script, [&machine](uint64_t n)
+                                                     { machine.RunCycles<B>(n); });
+    return chip8;
+}
+
+static RunResult BenchROM(char const *filename, uint64_t cycles, unsigned int seed, std::vector<KeyEvent> const &script)
+{
+    RunResult result{};
+    result.cycles = cycles;
+
+    auto table = TimeBackend<Backend::Table>(filename, cycles, seed, script, result);
+    auto flat = TimeBackend<Backend::Switch>(filename, cycles, seed, script, result);
+    auto cached = TimeBackend<Backend::Cached>(filename, cycles, seed, script, result);
+    result.match = SameState(*table, *flat) && SameState(*table, *cached);
+    result.idleFraction = static_cast<double>(cached->idleCycles) / cycles;
+
+#ifdef CHIP8_JIT
+    {
+        auto chip8 = NewMachine(filename, seed);
+        auto jit = std::make_unique<Jit>(*chip8);
+
+        result.seconds[3] = TimeScript(*chip8, cycles, script, [&jit](uint64_t n)
+                                       { jit->Run(n); });
+        result.match = result.match && SameState(*table, *chip8);
+    }
+#endif
+
+    // save, run on, restore and replay: must end in the same state
+    {
+        std::vector<uint8_t> state;
+        SaveState(*cached, state);
+        result.snapshotBytes = state.size();
+
+        auto replay = NewMachine(filename, seed);
+        cached->RunCycles(100000);
+        result.match = result.match && LoadState(*replay, state);
+        replay->RunCycles(100000);
+        result.match = result.match && SameState(*cached, *replay);
+
+        const int rounds = 10000;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; i++)
+        {
+            SaveState(*cached, state);
+        }
+        auto middle = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; i++)
+        {
+            LoadState(*replay, state);
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        result.savesPerSecond = rounds / std::chrono::duration<double>(middle - start).count();
+        result.loadsPerSecond = rounds / std::chrono::duration<double>(end - middle).count();
+    }
+
+    // ten minutes of 60 Hz frames through the rewind history
+    {
+        const uint64_t frames = 10 * 60 * TIMER_HZ;
+        const uint64_t sampleEvery = 997;
+
+        auto chip8 = NewMachine(filename, seed);
+        Rewind rewind;
+        std::vector<std::vector<uint8_t>> samples;
+        size_t next = 0;
+
+        for (uint64_t frame = 0; frame < frames; frame++)
+        {
+            while (next < script.size() && script[next].cycle <= chip8->cycles)
+            {
+                chip8->keypad[script[next].key] = script[next].down;
+                next++;
+            }
+
+            chip8->RunFrame();
+            rewind.Push(*chip8);
+
+            if (frame % sampleEvery == 0)
+            {
+                samples.emplace_back();
+                SaveState(*chip8, samples.back());
+            }
+        }
+
+        result.rewindBytes = rewind.Bytes();
+
+        auto seeker = NewMachine(filename, seed);
+        std::vector<uint8_t> state;
+        double seconds = 0;
+        int seeks = 0;
+
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            uint64_t frame = i * sampleEvery;
+            if (frame < rewind.First())
+            {
+                continue;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            bool found = rewind.Seek(*seeker, frame);
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            seeks++;
+
+            SaveState(*seeker, state);
+            result.match = result.match && found && state == samples[i];
+        }
+
+        result.seekMicroseconds = seeks ? seconds * 1e6 / seeks : 0.0;
+    }
+
+    // twenty seconds recorded as main records them, rewound two seconds past a
+    // key press while the key stays held: at every frame of the surviving
+    // timeline the movie must hold the keys the session held, and it must
+    // replay to the session's final state
+    {
+        const uint64_t frames = 20 * TIMER_HZ;
+        const uint64_t press = frames / 2;
+        const uint64_t stepsBack = 2 * TIMER_HZ;
+
+        auto chip8 = NewMachine(filename, seed);
+        MovieRecorder recorder(*chip8, seed);
+        Rewind rewind;
+        std::vector<MovieEvent> held; // keys at each frame start
+        size_t next = 0;
+
+        for (uint64_t frame = 0; frame < frames; frame++)
+        {
+            // like main, record only when an input event changes the keypad
+            while (next < script.size() && script[next].cycle <= chip8->cycles)
+            {
+                chip8->keypad[script[next].key] = script[next].down;
+                recorder.Record(*chip8);
+                next++;
+            }
+
+            if (frame == press)
+            {
+                chip8->keypad[5] = 1;
+                recorder.Record(*chip8);
+            }
+
+            held.push_back({chip8->cycles, KeypadMask(chip8->keypad)});
+            chip8->RunFrame();
+            rewind.Push(*chip8);
+
+            if (frame == press + TIMER_HZ)
+            {
+                uint8_t keys[sizeof(chip8->keypad)];
+                memcpy(keys, chip8->keypad, sizeof(keys));
+
+                for (uint64_t i = 0; i < stepsBack; i++)
+                {
+                    rewind.StepBack(*chip8);
+                    memcpy(chip8->keypad, keys, sizeof(keys));
+                    recorder.Rewound(*chip8);
+                    recorder.Record(*chip8);
+
+                    while (!held.empty() && held.back().cycle >= chip8->cycles)
+                    {
+                        held.pop_back();
+                    }
+                }
+            }
+        }
+
+        Movie const &movie = recorder.Finish(*chip8);
+        size_t event = 0;
+        uint16_t keys = 0;
+
+        for (MovieEvent const &frame : held)
+        {
+            while (event < movie.events.size() && movie.events[event].cycle <= frame.cycle)
+            {
+                keys = movie.events[event++].keys;
+            }
+            result.match = result.match && keys == frame.keys;
+        }
+
+        auto replay = NewMachine(filename, seed);
+        result.match = result.match && ReplayMovie(*replay, movie);
+    }
+
+    // ten seconds with two frames of run-ahead, as main -a 2 runs them
+    {
+        const uint64_t frames = 10 * TIMER_HZ;
+
+        auto plain = NewMachine(filename, seed);
+        auto chip8 = NewMachine(filename, seed);
+        RunAhead ahead(2);
+        double seconds = 0;
+        size_t next = 0;
+
+        for (uint64_t frame = 0; frame < frames; frame++)
+        {
+            while (next < script.size() && script[next].cycle <= chip8->cycles)
+            {
+                plain->keypad[script[next].key] = script[next].down;
+                chip8->keypad[script[next].key] = script[next].down;
+                next++;
+            }
+
+            plain->RunFrame();
+            chip8->RunFrame();
+
+            auto start = std::chrono::steady_clock::now();
+            ahead.Preview(*chip8, [](Chip8 const &) {});
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        result.runAheadMicroseconds = seconds * 1e6 / frames;
+        result.match = result.match && SameState(*plain, *chip8);
+    }
+
+    // second, untimed pass with the same seed and input for the opcode mix
+    {
+        auto chip8 = NewMachine(filename, seed);
+        Chip8 &machine = *chip8;
+
+        RunScript(machine, cycles, script, [&machine, &result](uint64_t n)
+                  {
+                      for (uint64_t i = 0; i < n; i++)
+                      {
+                          result.classCounts[machine.memory[machine.pc & 0xFFFu] >> 4u]++;
+                          machine.RunCycles(1);
+                      } });
+    }
+
+    return result;
+}
+
+static void PrintResult(std::string const &rom, RunResult const &result, bool last)
+{
+    std::cout << "  {\"rom\": \"" << rom << "\""
+              << ", \"cycles\": " << std::dec << result.cycles
+              << ", \"match\": " << (result.match ? "true" : "false");
+
+    for (int b = 0; b < ENGINE_COUNT; b++)
+    {
+        double seconds = result.seconds[b];
+        double mips = seconds > 0 ? result.cycles / seconds / 1e6 : 0.0;
+        double nsPerInstruction = result.cycles ? seconds * 1e9 / result.cycles : 0.0;
+
+        std::cout << ", \"" << ENGINE_NAMES[b] << "\": {\"seconds\": " << seconds
+                  << ", \"mips\": " << mips
+                  << ", \"ns_per_instruction\": " << nsPerInstruction << "}";
+    }
+
+    std::cout << ", \"snapshot_bytes\": " << result.snapshotBytes
+              << ", \"saves_per_second\": " << result.savesPerSecond
+              << ", \"loads_per_second\": " << result.loadsPerSecond
+              << ", \"rewind_bytes\": " << result.rewindBytes
+              << ", \"seek_us\": " << result.seekMicroseconds
+              << ", \"run_ahead_us\": " << result.runAheadMicroseconds
+              << ", \"idle\": " << result.idleFraction;
+
+    std::cout << ", \"classes\": {";
+
+    for (int i = 0; i < 16; i++)
+    {
+        std::cout << (i ? ", " : "") << "\"" << OPCODE_CLASSES[i] << "\": " << result.classCounts[i];
+    }
+
+    std::cout << "}}" << (last ? "\n" : ",\n");
+}
+
+// Time each expansion path on a random framebuffer and check they agree.
+static void BenchExpand()
+{
+    const int frames = 200;
+    std::vector<std::pair<char const *, ExpandFunc>> paths = {{"scalar", &ExpandScalar}};
+
+#ifdef CHIP8_EXPAND_SIMD
+    paths.push_back({"sse2", &ExpandSSE2});
+#endif
+
+    uint64_t rows[SCREEN_HEIGHT];
+    std::mt19937_64 random(1);
+    for (auto &row : rows)
+    {
+        row = random();
+    }
+
+    uint64_t original[SCREEN_HEIGHT];
+    memcpy(original, rows, sizeof(rows));
+
+    std::cout << "{\"expand\": [\n";
+
+    for (int scale = 10; scale <= 20; scale++)
+    {
+        int pitch = SCREEN_WIDTH * scale * 4;
+        std::vector<uint8_t> reference(pitch * SCREEN_HEIGHT * scale);
+        std::vector<uint8_t> out(reference.size());
+        bool match = true;
+
+        ExpandScalar(rows, SCREEN_WIDTH, SCREEN_HEIGHT, scale, 0xFF000000u, 0xFFFFFFFFu, reference.data(), pitch);
+
+        std::cout << "  {\"scale\": " << scale;
+
+        for (auto const &path : paths)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < frames; i++)
+            {
+                rows[i % SCREEN_HEIGHT] ^= 1u; // keep the work from being hoisted
+                path.second(rows, SCREEN_WIDTH, SCREEN_HEIGHT, scale, 0xFF000000u, 0xFFFFFFFFu, out.data(), pitch);
+            }
+            auto end = std::chrono::steady_clock::now();
+
+            memcpy(rows, original, sizeof(rows));
+            path.second(rows, SCREEN_WIDTH, SCREEN_HEIGHT, scale, 0xFF000000u, 0xFFFFFFFFu, out.data(), pitch);
+            match = match && out == reference;
+
+            double ns = std::chrono::duration<double, std::nano>(end - start).count() / frames;
+            std::cout << ", \"" << path.first << "_ns_per_frame\": " << ns;
+        }
+
+        std::cout << ", \"match\": " << (match ? "true" : "false") << "}" << (scale < 20 ? ",\n" : "\n");
+    }
+
+    std::cout << "]}\n";
+}
+
+// Replay a movie on every fast engine and report whether each reproduced it.
+static int ReplayROM(char const *movieFilename, char const *filename)
+{
+    Movie movie;
+    if (!LoadMovie(movieFilename, movie))
+    {
+        std::cerr << "cannot read movie " << movieFilename << "\n";
+        return EXIT_FAILURE;
+    }
+
+    double realSeconds = static_cast<double>(movie.length) / movie.cyclesPerFrame / TIMER_HZ;
+    bool allMatch = true;
+
+    std::cout << "{\"movie\": \"" << movieFilename << "\", \"rom\": \"" << filename << "\""
+              << ", \"cycles\": " << movie.length << ", \"events\": " << movie.events.size()
+              << ", \"recorded_seconds\": " << realSeconds;
+
+    for (int b = static_cast<int>(Backend::Cached); b < ENGINE_COUNT; b++)
+    {
+        auto chip8 = NewMachine(filename, movie.seed);
+        bool match;
+
+        auto start = std::chrono::steady_clock::now();
+#ifdef CHIP8_JIT
+        if (b == 3)
+        {
+            Jit jit(*chip8);
+            match = ReplayMovie(*chip8, movie, [&jit](uint64_t n)
+                                { jit.Run(n); });
+        }
+        else
+#endif
+        {
+            match = ReplayMovie(*chip8, movie);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << ", \"" << ENGINE_NAMES[b] << "\": {\"seconds\": " << seconds
+                  << ", \"realtime_factor\": " << (seconds > 0 ? realSeconds / seconds : 0.0)
+                  << ", \"match\": " << (match ? "true" : "false") << "}";
+        allMatch = allMatch && match;
+    }
+
+    std::cout << ", \"match\": " << (allMatch ? "true" : "false") << "}\n";
+    return allMatch ? 0 : EXIT_FAILURE;
+}
+
+// Keys a lockstep lane or fleet instance holds during a frame: lane 0 never
+// presses anything, the others now and then hold one key for 8 frames.
+static uint16_t LaneKeys(size_t lane, uint64_t frame)
+{
+    if (lane == 0)
+    {
+        return 0;
+    }
+
+    uint64_t h = lane * 0x9E3779B97F4A7C15ull ^ (frame / 8) * 0xC2B2AE3D27D4EB4Full;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+
+    return h & 3 ? 0 : 1u << ((h >> 8) & 0xF);
+}
+
+static std::unique_ptr<Fleet> NewFleet(std::vector<std::string> const &roms, size_t instances, unsigned int seed)
+{
+    auto fleet = std::make_unique<Fleet>(instances, seed);
+    for (size_t i = 0; i < instances; i++)
+    {
+        LoadMachine((*fleet)[i].chip8, roms[i % roms.size()].c_str());
+    }
+    return fleet;
+}
+
+static void PrintFleetStats(char const *name, FleetStats const &stats)
+{
+    std::cout << "\"" << name << "\": {\"threads\": " << stats.threads
+              << ", \"seconds\": " << stats.seconds
+              << ", \"mips\": " << (stats.seconds > 0 ? stats.cycles / stats.seconds / 1e6 : 0.0)
+              << ", \"tasks\": " << stats.tasks
+              << ", \"steals\": " << stats.steals << "}";
+}
+
+static int RunFleet(std::vector<std::string> const &roms, size_t instances, unsigned int threads, uint64_t cycles, unsigned int seed)
+{
+    // instance i is fed the keys of lockstep lane i + 1
+    auto feed = [](Chip8 &chip8, size_t instance, uint64_t frame)
+    { SetKeypad(chip8.keypad, LaneKeys(instance + 1, frame)); };
+
+    auto serial = NewFleet(roms, instances, seed);
+    FleetStats single = serial->RunCycles(cycles, 1, Fleet::DEFAULT_FRAMES_PER_TASK, feed);
+
+    auto parallel = NewFleet(roms, instances, seed);
+    FleetStats many = parallel->RunCycles(cycles, threads, Fleet::DEFAULT_FRAMES_PER_TASK, feed);
+
+    bool match = true;
+    for (size_t i = 0; i < instances; i++)
+    {
+        match = match && (*serial)[i].stateHash == (*parallel)[i].stateHash;
+    }
+
+    // the last instance again on its own, fed the same keys
+    {
+        size_t last = instances - 1;
+        auto chip8 = NewMachine(roms[last % roms.size()].c_str(), seed + last);
+        uint64_t frames = (*parallel)[last].chip8.cycles / (*parallel)[last].chip8.cyclesPerFrame;
+
+        for (uint64_t frame = 0; frame < frames; frame++)
+        {
+            feed(*chip8, last, frame);
+            chip8->RunFrame();
+        }
+        match = match && StateHash(*chip8) == (*parallel)[last].stateHash;
+    }
+
+    uint64_t idle = 0;
+    for (size_t i = 0; i < instances; i++)
+    {
+        idle += (*parallel)[i].chip8.idleCycles;
+    }
+
+    std::cout << "{\"instances\": " << instances
+              << ", \"idle\": " << (many.cycles ? static_cast<double>(idle) / many.cycles : 0.0) << ", ";
+    PrintFleetStats("single", single);
+    std::cout << ", ";
+    PrintFleetStats("parallel", many);
+    std::cout << ", \"speedup\": " << (many.seconds > 0 ? single.seconds / many.seconds : 0.0)
+              << ", \"match\": " << (match ? "true" : "false") << ", \"results\": [\n";
+
+    for (size_t i = 0; i < instances; i++)
+    {
+        std::cout << "  {\"rom\": \"" << roms[i % roms.size()] << "\", \"seed\": " << seed + i
+                  << ", \"frames\": " << (*parallel)[i].chip8.cycles / (*parallel)[i].chip8.cyclesPerFrame
+                  << ", \"cycles\": " << (*parallel)[i].chip8.cycles
+                  << ", \"idle_cycles\": " << (*parallel)[i].chip8.idleCycles
+                  << ", \"state_hash\": \"" << std::hex << (*parallel)[i].stateHash << std::dec << "\"}"
+                  << (i + 1 < instances ? ",\n" : "\n");
+    }
+
+    std::cout << "]}\n";
+    return match ? 0 : EXIT_FAILURE;
+}
+
+static bool RunLockstep(char const *filename, size_t lanes, uint64_t cycles, unsigned int seed, bool last)
+{
+    Fleet fleet(lanes, seed);
+    for (size_t lane = 0; lane < lanes; lane++)
+    {
+        fleet[lane].chip8.randGen.seed(seed);
+        LoadMachine(fleet[lane].chip8, filename);
+    }
+
+    // every lane runs the same ROM, so at the same instructions per frame
+    uint64_t frames = std::max<uint64_t>(1, cycles / fleet[0].chip8.cyclesPerFrame);
+
+    Lockstep lockstep(fleet);
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t frame = 0; frame < frames; frame++)
+    {
+        for (size_t lane = 0; lane < lanes; lane++)
+        {
+            SetKeypad(fleet[lane].chip8.keypad, LaneKeys(lane, frame));
+        }
+        lockstep.RunFrame();
+    }
+    lockstep.Sync();
+    double lockstepSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    bool match = true;
+    start = std::chrono::steady_clock::now();
+    for (size_t lane = 0; lane < lanes; lane++)
+    {
+        auto chip8 = NewMachine(filename, seed);
+        for (uint64_t frame = 0; frame < frames; frame++)
+        {
+            SetKeypad(chip8->keypad, LaneKeys(lane, frame));
+            chip8->RunFrame();
+        }
+        match = match && StateHash(*chip8) == StateHash(fleet[lane].chip8);
+    }
+    double scalarSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> scalarFraction(lanes);
+    for (size_t lane = 0; lane < lanes; lane++)
+    {
+        scalarFraction[lane] = static_cast<double>(lockstep.laneScalar[lane]) / lockstep.stats.steps;
+    }
+    std::sort(scalarFraction.begin(), scalarFraction.end());
+
+    LockstepStats const &stats = lockstep.stats;
+    double laneCycles = static_cast<double>(stats.steps) * lanes;
+
+    std::cout << "  {\"rom\": \"" << filename << "\", \"lanes\": " << lanes << ", \"frames\": " << frames
+              << ", \"vectorized\": " << (lockstep.Vectorized() ? "true" : "false")
+              << ", \"lockstep\": {\"seconds\": " << lockstepSeconds << ", \"mips\": " << laneCycles / lockstepSeconds / 1e6 << "}"
+              << ", \"scalar\": {\"seconds\": " << scalarSeconds << ", \"mips\": " << laneCycles / scalarSeconds / 1e6 << "}"
+              << ", \"converged_steps\": " << static_cast<double>(stats.convergedSteps) / stats.steps
+              << ", \"vector_lane_steps\": " << stats.vectorLaneSteps / laneCycles
+              << ", \"detached_lane_steps\": " << stats.detachedLaneSteps / laneCycles
+              << ", \"detaches\": " << stats.detaches << ", \"joins\": " << stats.joins
+              << ", \"lane_scalar_fraction\": {\"min\": " << scalarFraction.front()
+              << ", \"median\": " << scalarFraction[lanes / 2]
+              << ", \"max\": " << scalarFraction.back() << "}"
+              << ", \"match\": " << (match ? "true" : "false") << "}" << (last ? "\n" : ",\n");
+
+    return match;
+}
+
+// Keys a netplay player holds during a frame
+static uint16_t PlayerKeys(unsigned int player, uint64_t frame)
+{
+    return LaneKeys(player + 1, frame);
+}
+
+static int RunNetplay(char const *filename, unsigned int player, uint16_t localPort, uint16_t remotePort,
+                      unsigned int latency, double loss, uint64_t frames, unsigned int seed)
+{
+
+    auto chip8 = NewMachine(filename, seed);
+    Netplay netplay(*chip8);
+
+    if (!netplay.Open(localPort, "127.0.0.1", remotePort))
+    {
+        std::cerr << "cannot open UDP port " << localPort << "\n";
+        return EXIT_FAILURE;
+    }
+    netplay.Link().Simulate(std::chrono::milliseconds(latency), loss, seed + player);
+
+    auto const framePeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / TIMER_HZ));
+    auto start = std::chrono::steady_clock::now();
+    auto giveUp = start + framePeriod * frames + std::chrono::seconds(10);
+    auto next = start;
+
+    // run every frame, then keep exchanging packets until the peer has
+    // all the input too, and a little longer so it learns that as well
+    std::chrono::steady_clock::time_point lingerUntil{};
+    bool synced = false;
+
+    while (!synced || next < lingerUntil)
+    {
+        uint64_t frame = netplay.History().Frame();
+        netplay.Tick(PlayerKeys(player, frame), frames);
+
+        if (netplay.Mismatched() || next > giveUp)
+        {
+            std::cerr << (netplay.Mismatched() ? "the peer runs another ROM or speed\n" : "the peer stopped answering\n");
+            return EXIT_FAILURE;
+        }
+
+        if (!synced && netplay.Synced(frames))
+        {
+            synced = true;
+            lingerUntil = next + std::max<std::chrono::steady_clock::duration>(std::chrono::milliseconds(500), 4 * std::chrono::milliseconds(latency));
+        }
+
+        next += framePeriod;
+        std::this_thread::sleep_until(next);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // the same frames with both players' keys known up front
+    auto reference = NewMachine(filename, seed);
+    for (uint64_t frame = 0; frame < frames; frame++)
+    {
+        SetKeypad(reference->keypad, PlayerKeys(0, frame) | PlayerKeys(1, frame));
+        reference->RunFrame();
+    }
+
+    uint64_t hash = StateHash(*chip8);
+    bool match = hash == StateHash(*reference) && netplay.desyncs == 0;
+
+    RollbackStats const &stats = netplay.History().Stats();
+    UdpLink const &link = netplay.Link();
+
+    std::cout << "{\"rom\": \"" << filename << "\", \"player\": " << player << ", \"frames\": " << frames
+              << ", \"seconds\": " << seconds
+              << ", \"latency_ms\": " << latency << ", \"loss\": " << loss
+              << ", \"rollbacks\": " << stats.rollbacks
+              << ", \"resimulated_frames\": " << stats.resimulatedFrames
+              << ", \"longest_rollback\": " << stats.longestRollback
+              << ", \"resimulation_us_per_frame\": " << stats.resimulationSeconds * 1e6 / frames
+              << ", \"us_per_resimulated_frame\": " << (stats.resimulatedFrames ? stats.resimulationSeconds * 1e6 / stats.resimulatedFrames : 0.0)
+              << ", \"stalls\": " << netplay.stalls
+              << ", \"desyncs\": " << netplay.desyncs
+              << ", \"packets\": {\"sent\": " << link.sent << ", \"dropped\": " << link.dropped << ", \"received\": " << link.received << "}"
+              << ", \"state_hash\": \"" << std::hex << hash << std::dec << "\""
+              << ", \"match\": " << (match ? "true" : "false") << "}\n";
+
+    return match ? 0 : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t cycles = 10000000;
+    unsigned int seed = 1;
+    std::vector<KeyEvent> script;
+    std::vector<std::string> roms;
+    char const *movieFilename = nullptr;
+    size_t instances = 0;
+    size_t lanes = 0;
+    int netPlayer = -1;
+    uint16_t localPort = 0;
+    uint16_t remotePort = 0;
+    unsigned int latency = 0;
+    double loss = 0;
+    uint64_t netFrames = 1800;
+    unsigned int threads = 0;
+
+    registry.LoadDatabase(RomDatabasePath());
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "-n" && i + 1 < argc)
+        {
+            cycles = static_cast<uint64_t>(std::stod(argv[++i]) * 1e6);
+        }
+        else if (arg == "-s" && i + 1 < argc)
+        {
+            seed = std::stoul(argv[++i]);
+        }
+        else if (arg == "-k" && i + 1 < argc)
+        {
+            script = LoadKeyScript(argv[++i]);
+        }
+        else if (arg == "-r" && i + 1 < argc)
+        {
+            movieFilename = argv[++i];
+        }
+        else if (arg == "-f" && i + 1 < argc)
+        {
+            instances = std::stoul(argv[++i]);
+        }
+        else if (arg == "-l" && i + 1 < argc)
+        {
+            lanes = std::stoul(argv[++i]);
+        }
+        else if (arg == "-t" && i + 1 < argc)
+        {
+            threads = std::stoul(argv[++i]);
+        }
+        else if (arg == "-p" && i + 1 < argc && FindQuirkProfile(argv[i + 1], profileQuirks))
+        {
+            profileName = argv[++i];
+        }
+        else if (arg == "-net" && i + 3 < argc)
+        {
+            netPlayer = std::stoi(argv[++i]) ? 1 : 0;
+            localPort = static_cast<uint16_t>(std::stoul(argv[++i]));
+            remotePort = static_cast<uint16_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "-latency" && i + 1 < argc)
+        {
+            latency = std::stoul(argv[++i]);
+        }
+        else if (arg == "-loss" && i + 1 < argc)
+        {
+            loss = std::stod(argv[++i]) / 100;
+        }
+        else if (arg == "-frames" && i + 1 < argc)
+        {
+            netFrames = std::max<uint64_t>(1, std::stoull(argv[++i]));
+        }
+        else if (arg == "-i")
+        {
+            skipIdle = true;
+        }
+        else if (arg == "-x")
+        {
+            BenchExpand();
+            return 0;
+        }
+        else if (std::filesystem::is_directory(arg))
+        {
+            for (auto const &entry : std::filesystem::directory_iterator(arg))
+            {
+                if (entry.is_regular_file())
+                {
+                    roms.push_back(entry.path().string());
+                }
+            }
+        }
+        else if (std::filesystem::is_regular_file(arg))
+        {
+            roms.push_back(arg);
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [-n <millions>] [-s <seed>] [-k <keyscript>] [-p <profile>] [-i] [ROM or dir ...]\n"
+                      << "       " << argv[0] << " -x\n"
+                      << "       " << argv[0] << " -r <movie> <ROM>\n"
+                      << "       " << argv[0] << " -f <instances> [-t <threads>] [-n <millions>] [-s <seed>] [-i] [ROM or dir ...]\n"
+                      << "       " << argv[0] << " -l <lanes> [-n <millions>] [-s <seed>] [ROM or dir ...]\n"
+                      << "       " << argv[0] << " -net <player> <local port> <remote port> [-latency <ms>] [-loss <percent>] [-frames <count>] [-s <seed>] <ROM>\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    if (movieFilename)
+    {
+        if (roms.size() != 1)
+        {
+            std::cerr << "-r needs exactly one ROM\n";
+            std::exit(EXIT_FAILURE);
+        }
+
+        return ReplayROM(movieFilename, roms[0].c_str());
+    }
+
+    if (netPlayer >= 0)
+    {
+        if (roms.size() != 1)
+        {
+            std::cerr << "-net needs exactly one ROM\n";
+            std::exit(EXIT_FAILURE);
+        }
+
+        return RunNetplay(roms[0].c_str(), netPlayer, localPort, remotePort, latency, loss, netFrames, seed);
+    }
+
+    if (roms.empty())
+    {
+        for (auto const &entry : std::filesystem::directory_iterator("tests"))
+        {
+            roms.push_back(entry.path().string());
+        }
+    }
+
+    std::sort(roms.begin(), roms.end());
+
+    if (instances > 0)
+    {
+        return RunFleet(roms, instances, threads, cycles, seed);
+    }
+
+    if (lanes > 0)
+    {
+        bool allMatch = true;
+
+        std::cout << "{\"lockstep\": [\n";
+        for (size_t i = 0; i < roms.size(); i++)
+        {
+            allMatch = RunLockstep(roms[i].c_str(), lanes, cycles, seed, i + 1 == roms.size()) && allMatch;
+        }
+        std::cout << "], \"match\": " << (allMatch ? "true" : "false") << "}\n";
+
+        return allMatch ? 0 : EXIT_FAILURE;
+    }
+
+    uint64_t totalCycles = 0;
+    double totalSeconds[4] = {};
+    bool allMatch = true;
+
+    std::cout << "{\"results\": [\n";
+
+    for (size_t i = 0; i < roms.size(); i++)
+    {
+        RunResult result = BenchROM(roms[i].c_str(), cycles, seed, script);
+        PrintResult(roms[i], result, i + 1 == roms.size());
+
+        totalCycles += result.cycles;
+        for (int b = 0; b < ENGINE_COUNT; b++)
+        {
+            totalSeconds[b] += result.seconds[b];
+        }
+        allMatch = allMatch && result.match;
+    }
+
+    std::cout << "], \"total_cycles\": " << totalCycles
+              << ", \"match\": " << (allMatch ? "true" : "false");
+
+    for (int b = 0; b < ENGINE_COUNT; b++)
+    {
+        std::cout << ", \"" << ENGINE_NAMES[b] << "_mips\": "
+                  << (totalSeconds[b] > 0 ? totalCycles / totalSeconds[b] / 1e6 : 0.0);
+    }
+
+    std::cout << "}\n";
+
+    if (!allMatch)
+    {
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
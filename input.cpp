@@ -0,0 +1,159 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include "chip8.cpp"
+
+// Timestamped keypad input.
+//
+// The SDL thread stamps every keypad change with the host time SDL received
+// it and pushes it into an InputQueue; the emulation thread runs each batch
+// of instructions with RunWithInput, which applies the events at the cycle
+// matching their time instead of all at once at the frame start. A key
+// pressed and released between two frames is therefore still seen, for as
+// long as it was actually held.
+
+struct InputEvent
+{
+	uint64_t time; // host time, InputQueue::Now() nanoseconds
+	uint8_t key;
+	uint8_t down;
+};
+
+// Single producer, single consumer ring of N - 1 entries, N a power of two.
+template <typename T, size_t N>
+class SpscQueue
+{
+	static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+	// producer: false if full
+	bool Push(T const &value)
+	{
+		size_t tail = this->tail.load(std::memory_order_relaxed);
+		if (((tail + 1) & (N - 1)) == head.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+
+		slots[tail] = value;
+		this->tail.store((tail + 1) & (N - 1), std::memory_order_release);
+		return true;
+	}
+
+	// consumer: the oldest entry, if any, stays queued until Pop()
+	bool Peek(T &value) const
+	{
+		size_t head = this->head.load(std::memory_order_relaxed);
+		if (head == tail.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+
+		value = slots[head];
+		return true;
+	}
+
+	void Pop()
+	{
+		head.store((head.load(std::memory_order_relaxed) + 1) & (N - 1), std::memory_order_release);
+	}
+
+	bool Empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+private:
+	T slots[N];
+	alignas(64) std::atomic<size_t> head{0}; // next to read, owned by the consumer
+	alignas(64) std::atomic<size_t> tail{0}; // next to write, owned by the producer
+};
+
+class InputQueue
+{
+public:
+	static constexpr size_t CAPACITY = 256;
+
+	static uint64_t Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// SDL side: queue an event and wake a waiting emulation thread. Returns
+	// false, dropping the event, if the queue is full.
+	bool Push(InputEvent const &event)
+	{
+		bool queued = queue.Push(event);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		pushed.notify_all();
+		return queued;
+	}
+
+	// emulation side
+	bool Peek(InputEvent &event) const { return queue.Peek(event); }
+	void Pop() { queue.Pop(); }
+
+	// Block until an event is queued or the deadline passes.
+	void WaitForEvent(std::chrono::steady_clock::time_point deadline)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		pushed.wait_until(lock, deadline, [&]
+						  { return !queue.Empty(); });
+	}
+
+private:
+	SpscQueue<InputEvent, CAPACITY> queue;
+	std::mutex mutex; // only for sleeping in WaitForEvent
+	std::condition_variable pushed;
+};
+
+// Run batch instructions standing for the host time (start, end] (Now()
+// nanoseconds), applying every event queued up to end at the proportional
+// cycle. Events are applied at least one instruction apart, so even a tap
+// shorter than one instruction is held for one; events that no longer fit
+// stay queued for the next batch. changed(chip8) is called after each
+// applied event, e.g. to record it.
+template <typename Changed>
+void RunWithInput(Chip8 &chip8, uint64_t batch, uint64_t start, uint64_t end, InputQueue &input, Changed &&changed)
+{
+	uint64_t done = 0;
+	bool applied = false;
+	InputEvent event;
+
+	while (input.Peek(event) && event.time <= end)
+	{
+		uint64_t at = event.time > start && end > start ? (event.time - start) * batch / (end - start) : 0;
+		if (applied && at <= done)
+		{
+			at = done + 1;
+		}
+		if (at > batch)
+		{
+			break;
+		}
+
+		chip8.RunCycles(at - done);
+		done = at;
+
+		chip8.keypad[event.key & 0xFu] = event.down;
+		input.Pop();
+		applied = true;
+		changed(chip8);
+	}
+
+	chip8.RunCycles(batch - done);
+}
+
+// Apply every event queued up to end straight to keypad, e.g. while no
+// instructions run.
+inline void ApplyInput(uint8_t *keypad, uint64_t end, InputQueue &input)
+{
+	InputEvent event;
+	while (input.Peek(event) && event.time <= end)
+	{
+		keypad[event.key & 0xFu] = event.down;
+		input.Pop();
+	}
+}
@@ -0,0 +1,642 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "chip8.cpp"
+
+// Basic-block recompiler from CHIP-8 to x86-64.
+//
+// Straight-line runs of register instructions (6xkk, 7xkk, 8xyn, Annn, Fx1E)
+// are translated into native code, ending at a jump, call, return or skip
+// (1nnn, 2nnn, 00EE, Bnnn, 3xkk, 4xkk, 5xy0, 9xy0, Ex9E, ExA1) or before any
+// instruction that is left to the interpreter (drawing, random numbers, key
+// waits, memory access). Timer reads and writes (Fx07, Fx15, Fx18) are native
+// since the timers only tick between calls into translated code.
+//
+// Blocks chain to each other through the entry[] table: every exit stores pc
+// and jumps through entry[pc], which points either at the next translated
+// block or at the exit stub that returns to Run(). Each block first checks
+// that its length fits in the remaining cycle budget, so Run() executes
+// exactly the number of instructions asked for.
+//
+// Only the interpreter writes memory (OP_Fx33, OP_Fx55, OP_5xy2), and it
+// reports those writes through Chip8::codeWriteHook; blocks covering the
+// written bytes are unlinked and retranslated on their next use. Only code
+// below CODE_SIZE is translated.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_JIT 1
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+class Jit
+{
+public:
+	static constexpr size_t ARENA_SIZE = 1u << 20;
+	static constexpr int MAX_BLOCK_INSTRUCTIONS = 64;
+	static constexpr size_t MAX_BLOCK_BYTES = 64 + MAX_BLOCK_INSTRUCTIONS * 32 + 128;
+	static constexpr unsigned COVERED_SIZE = CODE_SIZE + 2; // a block ending in a skip at CODE_SIZE - 2 covers the next word
+
+	explicit Jit(Chip8 &chip8)
+		: chip8(chip8)
+	{
+#ifdef _WIN32
+		arena = static_cast<uint8_t *>(VirtualAlloc(nullptr, ARENA_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+#else
+		void *mapped = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		arena = mapped == MAP_FAILED ? nullptr : static_cast<uint8_t *>(mapped);
+#endif
+
+		uint8_t const *base = reinterpret_cast<uint8_t const *>(&chip8);
+		registersOffset = reinterpret_cast<uint8_t const *>(chip8.registers) - base;
+		pcOffset = reinterpret_cast<uint8_t const *>(&chip8.pc) - base;
+		indexOffset = reinterpret_cast<uint8_t const *>(&chip8.index) - base;
+		stackOffset = reinterpret_cast<uint8_t const *>(chip8.stack) - base;
+		spOffset = reinterpret_cast<uint8_t const *>(&chip8.sp) - base;
+		keypadOffset = reinterpret_cast<uint8_t const *>(chip8.keypad) - base;
+		delayOffset = reinterpret_cast<uint8_t const *>(&chip8.delayTimer) - base;
+		soundOffset = reinterpret_cast<uint8_t const *>(&chip8.soundTimer) - base;
+		opcodeOffset = reinterpret_cast<uint8_t const *>(&chip8.opcode) - base;
+
+		Flush();
+
+		chip8.codeWriteHook = &Jit::OnCodeWrite;
+		chip8.codeWriteContext = this;
+	}
+
+	~Jit()
+	{
+		chip8.codeWriteHook = nullptr;
+		chip8.codeWriteContext = nullptr;
+
+#ifdef _WIN32
+		VirtualFree(arena, 0, MEM_RELEASE);
+#else
+		if (arena)
+		{
+			munmap(arena, ARENA_SIZE);
+		}
+#endif
+	}
+
+	Jit(Jit const &) = delete;
+	Jit &operator=(Jit const &) = delete;
+
+	// Execute exactly `cycles` instructions, translated where possible. Like
+	// Chip8::RunCycles the timers tick on frame boundaries, which never fall
+	// inside a call into translated code.
+	void Run(uint64_t cycles)
+	{
+		while (cycles > 0)
+		{
+			uint32_t chunk = cycles < chip8.CyclesToFrameEnd() ? static_cast<uint32_t>(cycles) : chip8.CyclesToFrameEnd();
+			uint32_t done = 0;
+
+			while (done < chunk)
+			{
+				if (chip8.skipIdle && chip8.IdleLoopLength())
+				{
+					chip8.SkipIdle(chunk - done);
+					break;
+				}
+
+				uint16_t pc = chip8.pc;
+
+				if (arena && pc < CODE_SIZE - 1)
+				{
+					if (state[pc] == Unknown)
+					{
+						Compile(pc);
+					}
+
+					if (state[pc] == Compiled)
+					{
+						int64_t budget = chunk - done;
+						int64_t executed = budget - enter(&chip8, budget, entry[pc]);
+
+						if (executed > 0)
+						{
+							done += executed;
+							nativeInstructions += executed;
+							continue;
+						}
+					}
+				}
+
+				// untranslatable instruction, or a block longer than the remaining budget
+				chip8.RunSteps<Backend::Cached>(1);
+				done++;
+				interpretedInstructions++;
+			}
+
+			chip8.Advance(chunk);
+			cycles -= chunk;
+		}
+	}
+
+	uint64_t nativeInstructions = 0;
+	uint64_t interpretedInstructions = 0;
+	uint64_t blocksCompiled = 0;
+	uint64_t blocksInvalidated = 0;
+
+private:
+	enum BlockState : uint8_t
+	{
+		Unknown,
+		Compiled,
+		Interpret
+	};
+
+	enum OpKind
+	{
+		NotNative,
+		Native,
+		Terminator
+	};
+
+	struct Block
+	{
+		uint16_t start;
+		uint16_t end;
+	};
+
+	typedef int64_t (*EnterFunc)(Chip8 *chip8, int64_t budget, void *code);
+
+	// Drop every block and start the arena over with the shared stubs.
+	void Flush()
+	{
+		blocks.clear();
+		memset(state, Unknown, sizeof(state));
+		memset(covered, 0, sizeof(covered));
+
+		if (!arena)
+		{
+			return;
+		}
+
+		cursor = arena;
+
+		// exit stub: return the remaining budget
+		exitStub = cursor;
+		Byte(0x4C), Byte(0x89), Byte(0xE0); // mov rax, r12
+		Byte(0x41), Byte(0x5C);				// pop r12
+		Byte(0x5B);							// pop rbx
+		Byte(0xC3);							// ret
+
+		// entry trampoline: enter(chip8, budget, code)
+		enter = reinterpret_cast<EnterFunc>(cursor);
+		Byte(0x53);			  // push rbx
+		Byte(0x41), Byte(0x54); // push r12
+#ifdef _WIN32
+		Byte(0x48), Byte(0x89), Byte(0xCB);	// mov rbx, rcx
+		Byte(0x49), Byte(0x89), Byte(0xD4);	// mov r12, rdx
+		Byte(0x41), Byte(0xFF), Byte(0xE0); // jmp r8
+#else
+		Byte(0x48), Byte(0x89), Byte(0xFB); // mov rbx, rdi
+		Byte(0x49), Byte(0x89), Byte(0xF4); // mov r12, rsi
+		Byte(0xFF), Byte(0xE2);				// jmp rdx
+#endif
+
+		for (size_t i = 0; i < CODE_SIZE; i++)
+		{
+			entry[i] = exitStub;
+		}
+	}
+
+	static void OnCodeWrite(void *context, uint16_t address, uint16_t length)
+	{
+		static_cast<Jit *>(context)->Invalidate(address, length);
+	}
+
+	// A write to [address, address + length) changes instructions starting at
+	// address - 1. Addresses wrap at the end of memory like the interpreter's.
+	void Invalidate(uint16_t address, uint16_t length)
+	{
+		if (length >= CODE_SIZE)
+		{
+			length = CODE_SIZE;
+		}
+
+		bool hit = false;
+
+		for (uint16_t i = 0; i <= length && !hit; i++)
+		{
+			uint16_t written = (address + i - 1) & ADDRESS_MASK;
+			hit = written < COVERED_SIZE && covered[written] != 0;
+		}
+
+		if (!hit)
+		{
+			return;
+		}
+
+		for (size_t b = 0; b < blocks.size();)
+		{
+			Block block = blocks[b];
+			bool overlaps = false;
+
+			for (uint16_t i = 0; i <= length && !overlaps; i++)
+			{
+				uint16_t written = (address + i - 1) & ADDRESS_MASK;
+				overlaps = written >= block.start && written < block.end;
+			}
+
+			if (overlaps)
+			{
+				entry[block.start] = exitStub;
+				state[block.start] = Unknown;
+
+				for (int i = block.start; i < block.end; i++)
+				{
+					covered[i]--;
+				}
+
+				blocks[b] = blocks.back();
+				blocks.pop_back();
+				blocksInvalidated++;
+			}
+			else
+			{
+				b++;
+			}
+		}
+	}
+
+	uint16_t Fetch(uint16_t address) const
+	{
+		return chip8.Fetch(address);
+	}
+
+	static bool IsSkip(uint16_t op)
+	{
+		switch (op >> 12u)
+		{
+		case 0x3:
+		case 0x4:
+			return true;
+		case 0x5:
+		case 0x9:
+		case 0xE:
+			return Classify(op) == Terminator;
+		default:
+			return false;
+		}
+	}
+
+	// Mirrors the decoding of the dispatch tables.
+	static OpKind Classify(uint16_t op)
+	{
+		switch (op >> 12u)
+		{
+		case 0x0:
+			return op == 0x00EE ? Terminator : NotNative;
+		case 0x1:
+		case 0x2:
+		case 0x3:
+		case 0x4:
+		case 0xB:
+			return Terminator;
+		case 0x5:
+		case 0x9:
+			return (op & 0x000Fu) == 0 ? Terminator : NotNative;
+		case 0x6:
+		case 0x7:
+		case 0xA:
+			return Native;
+		case 0x8:
+			return (op & 0x000Fu) <= 0x7 || (op & 0x000Fu) == 0xE ? Native : NotNative;
+		case 0xE:
+			return (op & 0x000Fu) == 0x1 || (op & 0x000Fu) == 0xE ? Terminator : NotNative;
+		case 0xF:
+			switch (op & 0x00FFu)
+			{
+			case 0x07:
+			case 0x15:
+			case 0x18:
+			case 0x1E:
+				return Native;
+			default:
+				return NotNative;
+			}
+		default:
+			return NotNative;
+		}
+	}
+
+	void Compile(uint16_t start)
+	{
+		if (Classify(Fetch(start)) == NotNative)
+		{
+			state[start] = Interpret;
+			return;
+		}
+
+		if (static_cast<size_t>(arena + ARENA_SIZE - cursor) < MAX_BLOCK_BYTES)
+		{
+			Flush();
+		}
+
+		uint8_t *code = cursor;
+
+		// cmp r12, length; jl exit; sub r12, length
+		Byte(0x49), Byte(0x81), Byte(0xFC);
+		uint8_t *lengthCheck = cursor;
+		Dword(0);
+		JumpCC(0x8C, exitStub);
+		Byte(0x49), Byte(0x81), Byte(0xEC);
+		uint8_t *lengthSub = cursor;
+		Dword(0);
+
+		uint16_t address = start;
+		int32_t count = 0;
+
+		for (;;)
+		{
+			uint16_t op = Fetch(address);
+			OpKind kind = Classify(op);
+
+			if (kind == NotNative)
+			{
+				StoreOpcode(Fetch(address - 2));
+				Chain(address);
+				break;
+			}
+
+			count++;
+
+			if (kind == Terminator)
+			{
+				StoreOpcode(op);
+				EmitInstruction(op, address);
+				break;
+			}
+
+			EmitInstruction(op, address);
+			address += 2;
+
+			if (count == MAX_BLOCK_INSTRUCTIONS || address >= CODE_SIZE - 1)
+			{
+				StoreOpcode(op);
+				Chain(address);
+				break;
+			}
+		}
+
+		memcpy(lengthCheck, &count, sizeof(count));
+		memcpy(lengthSub, &count, sizeof(count));
+
+		// a skip's target depends on the instruction after it (see Skip())
+		uint16_t end = address + (IsSkip(Fetch(address)) ? 4 : 2);
+		end = end < COVERED_SIZE ? end : COVERED_SIZE;
+		blocks.push_back({start, end});
+
+		for (int i = start; i < end; i++)
+		{
+			covered[i]++;
+		}
+
+		entry[start] = code;
+		state[start] = Compiled;
+		blocksCompiled++;
+	}
+
+	void EmitInstruction(uint16_t op, uint16_t address)
+	{
+		int32_t vx = registersOffset + ((op & 0x0F00u) >> 8u);
+		int32_t vy = registersOffset + ((op & 0x00F0u) >> 4u);
+		int32_t vf = registersOffset + 0xF;
+		uint8_t kk = op & 0x00FFu;
+		uint16_t nnn = op & 0x0FFFu;
+		uint16_t next = address + 2;
+
+		switch (op >> 12u)
+		{
+		case 0x0: // 00EE
+			Byte(0xFE), ModRM(1, spOffset);				  // dec byte [sp]
+			Byte(0x0F), Byte(0xB6), ModRM(0, spOffset);	  // movzx eax, byte [sp]
+			Byte(0x83), Byte(0xE0), Byte(0x0F);			  // and eax, 0xF
+			Byte(0x0F), Byte(0xB7), Byte(0x84), Byte(0x43); // movzx eax, word [stack + rax*2]
+			Dword(stackOffset);
+			ChainIndirect();
+			break;
+		case 0x1:
+			Chain(nnn);
+			break;
+		case 0x2:
+			Byte(0x0F), Byte(0xB6), ModRM(0, spOffset);		// movzx eax, byte [sp]
+			Byte(0x83), Byte(0xE0), Byte(0x0F);				// and eax, 0xF
+			Byte(0x66), Byte(0xC7), Byte(0x84), Byte(0x43); // mov word [stack + rax*2], next
+			Dword(stackOffset);
+			Word(next);
+			Byte(0xFE), ModRM(0, spOffset); // inc byte [sp]
+			Chain(nnn);
+			break;
+		case 0x3:
+			Byte(0x80), ModRM(7, vx), Byte(kk); // cmp byte [Vx], kk
+			Skip(0x84, next);
+			break;
+		case 0x4:
+			Byte(0x80), ModRM(7, vx), Byte(kk);
+			Skip(0x85, next);
+			break;
+		case 0x5:
+			LoadAL(vx), AluAL(0x3A, vy); // cmp al, [Vy]
+			Skip(0x84, next);
+			break;
+		case 0x9:
+			LoadAL(vx), AluAL(0x3A, vy);
+			Skip(0x85, next);
+			break;
+		case 0x6:
+			Byte(0xC6), ModRM(0, vx), Byte(kk); // mov byte [Vx], kk
+			break;
+		case 0x7:
+			Byte(0x80), ModRM(0, vx), Byte(kk); // add byte [Vx], kk
+			break;
+		case 0xA:
+			Byte(0x66), Byte(0xC7), ModRM(0, indexOffset), Word(nnn); // mov word [I], nnn
+			break;
+		case 0xB:
+			Byte(0x0F), Byte(0xB6), ModRM(0, chip8.quirks & QUIRK_JUMP_VX ? vx : registersOffset); // movzx eax, byte [V0 or Vx]
+			Byte(0x05), Dword(nnn);							   // add eax, nnn
+			ChainIndirect();
+			break;
+		case 0x8:
+			Emit8xyn(op & 0x000Fu, vx, vy, vf);
+			break;
+		case 0xE:
+			Byte(0x0F), Byte(0xB6), ModRM(0, vx);							  // movzx eax, byte [Vx]
+			Byte(0x83), Byte(0xE0), Byte(0x0F);								  // and eax, 0xF
+			Byte(0x80), Byte(0xBC), Byte(0x03), Dword(keypadOffset), Byte(0); // cmp byte [keypad + rax], 0
+			Skip((op & 0x000Fu) == 0xE ? 0x85 : 0x84, next);
+			break;
+		case 0xF:
+			switch (kk)
+			{
+			case 0x07:
+				LoadAL(delayOffset), StoreAL(vx);
+				break;
+			case 0x15:
+				LoadAL(vx), StoreAL(delayOffset);
+				break;
+			case 0x18:
+				LoadAL(vx), StoreAL(soundOffset);
+				break;
+			case 0x1E:
+				Byte(0x0F), Byte(0xB6), ModRM(0, vx);		   // movzx eax, byte [Vx]
+				Byte(0x66), Byte(0x01), ModRM(0, indexOffset); // add word [I], ax
+				break;
+			}
+			break;
+		}
+	}
+
+	// Leave the last executed instruction in Chip8::opcode, as Step() does.
+	void StoreOpcode(uint16_t op)
+	{
+		Byte(0x66), Byte(0xC7), ModRM(0, opcodeOffset), Word(op); // mov word [opcode], op
+	}
+
+	// Same order of reads and writes as the handlers, so VF aliasing Vx or Vy
+	// behaves identically.
+	void Emit8xyn(uint8_t n, int32_t vx, int32_t vy, int32_t vf)
+	{
+		int32_t vs = chip8.quirks & QUIRK_SHIFT_VY ? vy : vx; // shift source
+
+		switch (n)
+		{
+		case 0x0:
+			LoadAL(vy), StoreAL(vx);
+			break;
+		case 0x1:
+			LoadAL(vx), AluAL(0x0A, vy), StoreAL(vx); // or
+			break;
+		case 0x2:
+			LoadAL(vx), AluAL(0x22, vy), StoreAL(vx); // and
+			break;
+		case 0x3:
+			LoadAL(vx), AluAL(0x32, vy), StoreAL(vx); // xor
+			break;
+		case 0x4:
+			LoadAL(vx), AluAL(0x02, vy);		   // add al, [Vy]
+			Byte(0x0F), Byte(0x92), Byte(0xC1); // setc cl
+			Byte(0x88), ModRM(1, vf);		   // mov [VF], cl
+			StoreAL(vx);
+			break;
+		case 0x5:
+			LoadAL(vx), AluAL(0x3A, vy);		   // cmp al, [Vy]
+			Byte(0x0F), Byte(0x97), Byte(0xC1); // seta cl
+			Byte(0x88), ModRM(1, vf);
+			LoadAL(vx), AluAL(0x2A, vy), StoreAL(vx); // sub
+			break;
+		case 0x6:
+			LoadAL(vs), Byte(0x24), Byte(0x01), StoreAL(vf); // and al, 1
+			LoadAL(vs), Byte(0xD0), Byte(0xE8), StoreAL(vx); // shr al, 1
+			break;
+		case 0x7:
+			LoadAL(vy), AluAL(0x3A, vx);
+			Byte(0x0F), Byte(0x97), Byte(0xC1);
+			Byte(0x88), ModRM(1, vf);
+			LoadAL(vy), AluAL(0x2A, vx), StoreAL(vx);
+			break;
+		case 0xE:
+			LoadAL(vs), Byte(0xC0), Byte(0xE8), Byte(0x07), StoreAL(vf); // shr al, 7
+			LoadAL(vs), Byte(0x00), Byte(0xC0), StoreAL(vx);			 // add al, al
+			break;
+		}
+	}
+
+	// Store pc and continue at a fixed guest address.
+	void Chain(uint16_t target)
+	{
+		Byte(0x66), Byte(0xC7), ModRM(0, pcOffset), Word(target); // mov word [pc], target
+
+		if (target >= CODE_SIZE - 1)
+		{
+			Jump(exitStub);
+			return;
+		}
+
+		Byte(0x48), Byte(0xB8), Qword(reinterpret_cast<uint64_t>(&entry[target])); // mov rax, &entry[target]
+		Byte(0xFF), Byte(0x20);														  // jmp [rax]
+	}
+
+	// Store pc from eax and continue through entry[eax].
+	void ChainIndirect()
+	{
+		Byte(0x66), Byte(0x89), ModRM(0, pcOffset); // mov [pc], ax
+		Byte(0x3D), Dword(CODE_SIZE - 2);			 // cmp eax, CODE_SIZE - 2
+		JumpCC(0x87, exitStub);						 // ja exit
+		Byte(0x48), Byte(0xB9), Qword(reinterpret_cast<uint64_t>(entry)); // mov rcx, entry
+		Byte(0xFF), Byte(0x24), Byte(0xC1);								   // jmp [rcx + rax*8]
+	}
+
+	// Conditional skip: jcc taken goes past the instruction at next (four
+	// bytes for F000 nnnn), otherwise to next.
+	void Skip(uint8_t cc, uint16_t next)
+	{
+		Byte(0x0F), Byte(cc);
+		uint8_t *patch = cursor;
+		Dword(0);
+		Chain(next);
+
+		int32_t rel = static_cast<int32_t>(cursor - (patch + 4));
+		memcpy(patch, &rel, sizeof(rel));
+		Chain(next + (Fetch(next) == 0xF000u ? 4 : 2));
+	}
+
+	void LoadAL(int32_t disp) { Byte(0x8A), ModRM(0, disp); }
+	void StoreAL(int32_t disp) { Byte(0x88), ModRM(0, disp); }
+	void AluAL(uint8_t op, int32_t disp) { Byte(op), ModRM(0, disp); }
+
+	// [rbx + disp32] operand with reg field r
+	void ModRM(uint8_t r, int32_t disp)
+	{
+		Byte(0x80 | (r << 3) | 3);
+		Dword(disp);
+	}
+
+	void Jump(uint8_t const *target)
+	{
+		Byte(0xE9);
+		Dword(static_cast<int32_t>(target - (cursor + 4)));
+	}
+
+	void JumpCC(uint8_t cc, uint8_t const *target)
+	{
+		Byte(0x0F), Byte(cc);
+		Dword(static_cast<int32_t>(target - (cursor + 4)));
+	}
+
+	void Byte(uint8_t value) { *cursor++ = value; }
+	void Word(uint16_t value) { memcpy(cursor, &value, 2), cursor += 2; }
+	void Dword(uint32_t value) { memcpy(cursor, &value, 4), cursor += 4; }
+	void Qword(uint64_t value) { memcpy(cursor, &value, 8), cursor += 8; }
+
+	Chip8 &chip8;
+	uint8_t *arena = nullptr;
+	uint8_t *cursor = nullptr;
+	uint8_t *exitStub = nullptr;
+	EnterFunc enter = nullptr;
+
+	void *entry[CODE_SIZE];
+	uint8_t state[CODE_SIZE];
+	uint16_t covered[COVERED_SIZE];
+	std::vector<Block> blocks;
+
+	int32_t registersOffset;
+	int32_t pcOffset;
+	int32_t indexOffset;
+	int32_t stackOffset;
+	int32_t spOffset;
+	int32_t keypadOffset;
+	int32_t delayOffset;
+	int32_t soundOffset;
+	int32_t opcodeOffset;
+};
+
+#endif
@@ -0,0 +1,806 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "chip8.cpp"
+#include "runner.cpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#define CHIP8_LOCKSTEP_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define CHIP8_AVX2 __attribute__((target("avx2")))
+#else
+#define CHIP8_AVX2
+#endif
+
+// Lockstep engine: runs every machine of a Fleet (same ROM, e.g. one copy per
+// input sequence) one instruction per step, with the hot registers laid out as
+// structure-of-arrays so one AVX2 instruction updates 32 lanes.
+//
+// Lanes are either attached or detached. All attached lanes sit at the same
+// pc; their V0-VF, pc, I, opcode latch and timers live in lane-major arrays.
+// A register op, skip or jump (6xkk, 7xkk, 8xyn, Annn, Bnnn, 1nnn, 3xkk,
+// 4xkk, 5xy0, 9xy0, Fx07, Fx15, Fx18, Fx1E) runs on all of them as masked
+// vector code that performs the same reads and writes in the same order as
+// its handler. Any other instruction runs through each lane's own
+// Chip8::Step(), copying in and out only the registers it can touch.
+//
+// When an instruction leaves the attached lanes at different pcs, the
+// majority stays attached and the rest diverge: they are detached and their
+// registers are written back to their Chip8. Work is done in chunks that end
+// on frame boundaries; a lane detached during a chunk runs the rest of it on
+// its own, and it rejoins at a chunk end if it is back at the attached pc.
+// Regrouping then also happens if no lane stayed attached. Memory, stack,
+// keypad, screen and RNG always stay in each lane's Chip8, so the result is
+// bit-identical to Chip8::Cycle() on every lane.
+//
+// Every lane's memory starts out equal to lane 0's, except where marked in
+// written[]; writes reported through codeWriteHook add to it. Only where an
+// instruction's bytes are marked do lanes at the same pc need their opcodes
+// compared. Without AVX2 every lane simply runs Chip8::RunCycles().
+
+struct LockstepStats
+{
+	uint64_t steps = 0;
+	uint64_t convergedSteps = 0; // steps where every lane ran attached
+	uint64_t vectorLaneSteps = 0;
+	uint64_t attachedScalarLaneSteps = 0;
+	uint64_t detachedLaneSteps = 0;
+	uint64_t detaches = 0;
+	uint64_t joins = 0;
+};
+
+class Lockstep
+{
+public:
+	static constexpr size_t BLOCK = 32; // lanes per 256-bit vector of bytes
+
+	// All machines in fleet must have loaded the same ROM and share cycles,
+	// frameCycle, cyclesPerFrame and quirks. Between runs the lanes'
+	// registers are owned by the engine; call Sync() before reading them.
+	// Keypad and memory may be changed at any time.
+	explicit Lockstep(Fleet &fleet)
+		: fleet(fleet),
+		  lanes(fleet.Size()),
+		  padded((lanes + BLOCK - 1) / BLOCK * BLOCK),
+		  v(16 * padded), pc(padded), index(padded), opcode(padded),
+		  delayTimer(padded), soundTimer(padded), mask(padded), live(padded), resume(padded)
+	{
+		memset(live.data(), 0xFF, lanes);
+		laneScalar.assign(lanes, 0);
+		laneDetaches.assign(lanes, 0);
+		memset(written, 0, sizeof(written));
+
+		for (size_t lane = 1; lane < lanes; lane++)
+		{
+			for (unsigned int address = 0; address < MEMORY_SIZE; address++)
+			{
+				written[address] |= Lane(lane).memory[address] != Lane(0).memory[address];
+			}
+		}
+
+		for (size_t lane = 0; lane < lanes; lane++)
+		{
+			Lane(lane).codeWriteHook = &Lockstep::OnCodeWrite;
+			Lane(lane).codeWriteContext = this;
+		}
+
+#if defined(CHIP8_LOCKSTEP_SIMD) && defined(__GNUC__)
+		vectorized = lanes > 0 && __builtin_cpu_supports("avx2");
+#endif
+
+		if (vectorized)
+		{
+			Regroup();
+		}
+	}
+
+	~Lockstep()
+	{
+		Sync();
+
+		for (size_t lane = 0; lane < lanes; lane++)
+		{
+			Lane(lane).codeWriteHook = nullptr;
+			Lane(lane).codeWriteContext = nullptr;
+		}
+	}
+
+	Lockstep(Lockstep const &) = delete;
+	Lockstep &operator=(Lockstep const &) = delete;
+
+	// Run n instructions on every lane, ticking the timers on frame boundaries.
+	void RunCycles(uint64_t n)
+	{
+		if (!vectorized)
+		{
+			for (size_t lane = 0; lane < lanes; lane++)
+			{
+				Lane(lane).RunCycles(n);
+				laneScalar[lane] += n;
+			}
+			stats.steps += n;
+			stats.detachedLaneSteps += n * lanes;
+			return;
+		}
+
+#ifdef CHIP8_LOCKSTEP_SIMD
+		Chip8 &first = Lane(0);
+		while (n > 0)
+		{
+			uint32_t chunk = n < first.CyclesToFrameEnd() ? static_cast<uint32_t>(n) : first.CyclesToFrameEnd();
+
+			RunChunk(chunk);
+
+			first.cycles += chunk;
+			first.frameCycle += chunk;
+			if (first.frameCycle >= first.cyclesPerFrame)
+			{
+				first.frameCycle = 0;
+				TickTimers();
+			}
+
+			Rejoin();
+			n -= chunk;
+		}
+#endif
+	}
+
+	void RunFrame()
+	{
+		RunCycles(Lane(0).CyclesToFrameEnd());
+	}
+
+	// Write the attached lanes' registers and the cycle counters back to
+	// every lane's Chip8.
+	void Sync()
+	{
+		Chip8 const &first = Lane(0);
+
+		for (size_t lane = 0; lane < lanes; lane++)
+		{
+			if (mask[lane])
+			{
+				ScatterLane(lane);
+			}
+			Lane(lane).cycles = first.cycles;
+			Lane(lane).frameCycle = first.frameCycle;
+		}
+	}
+
+	bool Vectorized() const { return vectorized; }
+
+	// Instructions a lane ran in vector code; every lane runs one per step.
+	uint64_t LaneVector(size_t lane) const { return stats.steps - laneScalar[lane]; }
+
+	LockstepStats stats;
+	std::vector<uint64_t> laneScalar;	// per lane: instructions run by Chip8::Step()
+	std::vector<uint64_t> laneDetaches; // per lane: times it diverged from the attached group
+
+private:
+	Chip8 &Lane(size_t lane) { return fleet[lane].chip8; }
+
+	uint8_t *V(unsigned int r) { return v.data() + r * padded; }
+
+	static void OnCodeWrite(void *context, uint16_t address, uint16_t length)
+	{
+		Lockstep *self = static_cast<Lockstep *>(context);
+		for (unsigned int i = 0; i < length; i++)
+		{
+			self->written[(address + i) & ADDRESS_MASK] = 1;
+		}
+	}
+
+	void GatherLane(size_t lane)
+	{
+		Chip8 const &chip8 = Lane(lane);
+		for (unsigned int r = 0; r < 16; r++)
+		{
+			V(r)[lane] = chip8.registers[r];
+		}
+		pc[lane] = chip8.pc;
+		index[lane] = chip8.index;
+		opcode[lane] = chip8.opcode;
+		delayTimer[lane] = chip8.delayTimer;
+		soundTimer[lane] = chip8.soundTimer;
+	}
+
+	void ScatterLane(size_t lane)
+	{
+		Chip8 &chip8 = Lane(lane);
+		for (unsigned int r = 0; r < 16; r++)
+		{
+			chip8.registers[r] = V(r)[lane];
+		}
+		chip8.pc = pc[lane];
+		chip8.index = index[lane];
+		chip8.opcode = opcode[lane];
+		chip8.delayTimer = delayTimer[lane];
+		chip8.soundTimer = soundTimer[lane];
+	}
+
+	void Attach(size_t lane)
+	{
+		GatherLane(lane);
+		mask[lane] = 0xFF;
+		attached++;
+	}
+
+	void Detach(size_t lane, uint32_t done)
+	{
+		ScatterLane(lane);
+		resume[lane] = done;
+		mask[lane] = 0;
+		attached--;
+		laneDetaches[lane]++;
+		stats.detaches++;
+	}
+
+	uint16_t Fetch(size_t lane, uint16_t address)
+	{
+		uint8_t const *memory = Lane(lane).memory;
+		return memory[address & ADDRESS_MASK] << 8u | memory[(address + 1) & ADDRESS_MASK];
+	}
+
+	bool CodeShared(uint16_t address)
+	{
+		return !written[address & ADDRESS_MASK] && !written[(address + 1) & ADDRESS_MASK];
+	}
+
+	// Can lane join the attached lanes (its Chip8 is at their pc and holds the
+	// same instruction there)?
+	bool CanJoin(size_t lane)
+	{
+		uint16_t at = Lane(lane).pc;
+		return attached > 0 && at == groupPc && (CodeShared(at) || Fetch(lane, at) == Fetch(leader, at));
+	}
+
+	// With no lanes attached, attach every lane at the most common pc.
+	void Regroup()
+	{
+		uint16_t candidate = 0;
+		size_t votes = 0;
+
+		for (size_t lane = 0; lane < lanes; lane++)
+		{
+			uint16_t at = Lane(lane).pc;
+			if (votes == 0)
+			{
+				candidate = at;
+				leader = lane;
+			}
+			votes += at == candidate ? 1 : -1;
+		}
+
+		groupPc = candidate;
+		attached = 1;
+		for (size_t lane = 0; lane < lanes; lane++)
+		{
+			if (lane == leader || CanJoin(lane))
+			{
+				Attach(lane);
+			}
+		}
+		attached--;
+	}
+
+	static bool VectorOp(uint16_t op)
+	{
+		switch (op >> 12u)
+		{
+		case 0x1:
+		case 0x3:
+		case 0x4:
+		case 0x6:
+		case 0x7:
+		case 0xA:
+		case 0xB:
+			return true;
+		case 0x5:
+		case 0x9:
+			return (op & 0x000Fu) == 0;
+		case 0x8:
+			return (op & 0x000Fu) <= 0x7 || (op & 0x000Fu) == 0xE;
+		case 0xF:
+			switch (op & 0x00FFu)
+			{
+			case 0x07:
+			case 0x15:
+			case 0x18:
+			case 0x1E:
+				return true;
+			}
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	// A taken skip over XO-CHIP's four-byte F000 nnnn moves pc by 6, which
+	// the vector code does not do; such skips run through the handlers.
+	bool SkipsLongLoad(uint16_t op)
+	{
+		switch (op >> 12u)
+		{
+		case 0x3:
+		case 0x4:
+		case 0x5:
+		case 0x9:
+			return !CodeShared(groupPc + 2) || Fetch(leader, groupPc + 2) == 0xF000u;
+		default:
+			return false;
+		}
+	}
+
+	// Run op, which VectorOp() rejected, on an attached lane through its Chip8.
+	// Those handlers touch at most Vx, Vy, VF (V0-Vx for Fx55/Fx65/Fx75/Fx85,
+	// Vx-Vy for 5xy2/5xy3), pc, I and the opcode latch, never the timers.
+	void StepAttached(size_t lane, uint16_t op)
+	{
+		Chip8 &chip8 = Lane(lane);
+		unsigned int x = (op & 0x0F00u) >> 8u;
+		unsigned int y = (op & 0x00F0u) >> 4u;
+		unsigned int last = 0;
+
+		switch (op & 0xF0FFu)
+		{
+		case 0xF055u:
+		case 0xF065u:
+		case 0xF075u:
+		case 0xF085u:
+			last = x;
+			break;
+		}
+		if ((op & 0xF00Eu) == 0x5002u)
+		{
+			last = x > y ? x : y;
+		}
+
+		for (unsigned int r = 0; r <= last; r++)
+		{
+			chip8.registers[r] = V(r)[lane];
+		}
+		chip8.registers[x] = V(x)[lane];
+		chip8.registers[y] = V(y)[lane];
+		chip8.registers[0xF] = V(0xF)[lane];
+		chip8.pc = pc[lane];
+		chip8.index = index[lane];
+
+		chip8.RunSteps(1);
+
+		for (unsigned int r = 0; r <= last; r++)
+		{
+			V(r)[lane] = chip8.registers[r];
+		}
+		V(x)[lane] = chip8.registers[x];
+		V(y)[lane] = chip8.registers[y];
+		V(0xF)[lane] = chip8.registers[0xF];
+		pc[lane] = chip8.pc;
+		index[lane] = chip8.index;
+		opcode[lane] = chip8.opcode;
+
+		laneScalar[lane]++;
+	}
+
+#ifdef CHIP8_LOCKSTEP_SIMD
+
+	// Run n <= CyclesToFrameEnd() instructions on every lane. The attached
+	// lanes go step by step; a lane that diverges at some step runs the rest
+	// of the chunk on its own afterwards, which keeps one machine hot in the
+	// cache at a time. Lanes rejoin only at chunk ends, when all are level.
+	CHIP8_AVX2
+	void RunChunk(uint32_t n)
+	{
+		bool converged = attached == lanes;
+
+		for (size_t lane = 0; lane < lanes; lane++)
+		{
+			resume[lane] = 0;
+		}
+
+		for (uint32_t step = 0; step < n && attached > 0; step++)
+		{
+			StepGroup(step);
+		}
+
+		converged = converged && attached == lanes;
+		stats.convergedSteps += converged ? n : 0;
+
+		for (size_t b = 0; b < padded; b += BLOCK)
+		{
+			uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_andnot_si256(Load8(&mask[b]), Load8(&live[b]))));
+
+			while (bits)
+			{
+				size_t lane = b + __builtin_ctz(bits);
+				bits &= bits - 1;
+
+				Lane(lane).RunSteps(n - resume[lane]);
+
+				laneScalar[lane] += n - resume[lane];
+				stats.detachedLaneSteps += n - resume[lane];
+			}
+		}
+
+		stats.steps += n;
+	}
+
+	// After a chunk: let detached lanes at the group's pc join, or start a new
+	// group if every lane diverged.
+	void Rejoin()
+	{
+		if (attached == 0)
+		{
+			Regroup();
+			return;
+		}
+
+		for (size_t lane = 0; lane < lanes; lane++)
+		{
+			if (!mask[lane] && CanJoin(lane))
+			{
+				Attach(lane);
+				stats.joins++;
+			}
+		}
+	}
+
+	// One instruction on every attached lane.
+	CHIP8_AVX2
+	void StepGroup(uint32_t step)
+	{
+		// lanes whose own memory holds a different instruction here diverge
+		uint16_t op = Fetch(leader, groupPc);
+		if (!CodeShared(groupPc))
+		{
+			for (size_t lane = 0; lane < lanes; lane++)
+			{
+				if (mask[lane] && Fetch(lane, groupPc) != op)
+				{
+					Detach(lane, step);
+				}
+			}
+
+			if (attached == 0)
+			{
+				return;
+			}
+		}
+
+		uint16_t next;
+
+		if (VectorOp(op) && !SkipsLongLoad(op))
+		{
+			size_t skips = ExecuteVector(op);
+			stats.vectorLaneSteps += attached;
+
+			switch (op >> 12u)
+			{
+			case 0x1:
+				next = op & 0x0FFFu;
+				break;
+			case 0x3:
+			case 0x4:
+			case 0x5:
+			case 0x9:
+				next = groupPc + (skips * 2 > attached ? 4 : 2);
+				break;
+			case 0xB:
+				next = pc[leader];
+				break;
+			default:
+				next = groupPc + 2;
+				break;
+			}
+		}
+		else
+		{
+			// majority vote for where the group continues
+			size_t votes = 0;
+			next = 0;
+
+			for (size_t lane = 0; lane < lanes; lane++)
+			{
+				if (mask[lane])
+				{
+					StepAttached(lane, op);
+					stats.attachedScalarLaneSteps++;
+
+					if (votes == 0)
+					{
+						next = pc[lane];
+					}
+					votes += pc[lane] == next ? 1 : -1;
+				}
+			}
+		}
+
+		Keep(next, step + 1);
+	}
+
+	// Detach the attached lanes whose pc is not target, which becomes the
+	// group's pc. They have run `done` steps of the current chunk.
+	CHIP8_AVX2
+	void Keep(uint16_t target, uint32_t done)
+	{
+		__m256i const wanted = _mm256_set1_epi16(static_cast<short>(target));
+
+		for (size_t b = 0; b < padded; b += BLOCK)
+		{
+			__m256i m8 = Load8(&mask[b]);
+			if (_mm256_testz_si256(m8, m8))
+			{
+				continue;
+			}
+
+			__m256i lo = _mm256_cmpeq_epi16(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(&pc[b])), wanted);
+			__m256i hi = _mm256_cmpeq_epi16(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(&pc[b + 16])), wanted);
+			__m256i same = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+			uint32_t lost = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_andnot_si256(same, m8)));
+
+			while (lost)
+			{
+				size_t lane = b + __builtin_ctz(lost);
+				lost &= lost - 1;
+				Detach(lane, done);
+			}
+		}
+
+		groupPc = target;
+
+		if (attached > 0 && !mask[leader])
+		{
+			while (!mask[leader])
+			{
+				leader = (leader + 1) % lanes;
+			}
+		}
+	}
+
+	// Execute op on every attached lane. Mirrors the handlers in chip8.cpp,
+	// including re-reading registers after VF is written. Returns how many
+	// lanes took a skip.
+	CHIP8_AVX2
+	size_t ExecuteVector(uint16_t op)
+	{
+		size_t skips = 0;
+
+		unsigned int x = (op & 0x0F00u) >> 8u;
+		unsigned int y = (op & 0x00F0u) >> 4u;
+		unsigned int s = Lane(leader).quirks & QUIRK_SHIFT_VY ? y : x; // shift source
+		unsigned int j = Lane(leader).quirks & QUIRK_JUMP_VX ? x : 0;	  // jump base
+		uint8_t kk = op & 0x00FFu;
+		uint16_t nnn = op & 0x0FFFu;
+
+		__m256i const zero = _mm256_setzero_si256();
+		__m256i const one = _mm256_set1_epi8(1);
+		__m256i const two = _mm256_set1_epi16(2);
+
+		for (size_t b = 0; b < padded; b += BLOCK)
+		{
+			__m256i m8 = Load8(&mask[b]);
+			if (_mm256_testz_si256(m8, m8))
+			{
+				continue;
+			}
+
+			__m256i m16[2] = {_mm256_cvtepi8_epi16(_mm256_castsi256_si128(m8)),
+							  _mm256_cvtepi8_epi16(_mm256_extracti128_si256(m8, 1))};
+
+			// every instruction: opcode latch and pc += 2; skipIf adds 2 more
+			__m256i skip = zero;
+			bool jump = false;
+			__m256i target[2] = {zero, zero};
+
+			for (int h = 0; h < 2; h++)
+			{
+				Store16(&opcode[b + 16 * h], _mm256_set1_epi16(static_cast<short>(op)), m16[h]);
+			}
+
+			switch (op >> 12u)
+			{
+			case 0x1:
+				jump = true;
+				target[0] = target[1] = _mm256_set1_epi16(static_cast<short>(nnn));
+				break;
+			case 0x3:
+				skip = _mm256_cmpeq_epi8(LoadV(x, b), _mm256_set1_epi8(static_cast<char>(kk)));
+				break;
+			case 0x4:
+				skip = _mm256_xor_si256(_mm256_cmpeq_epi8(LoadV(x, b), _mm256_set1_epi8(static_cast<char>(kk))), _mm256_set1_epi8(-1));
+				break;
+			case 0x5:
+				skip = _mm256_cmpeq_epi8(LoadV(x, b), LoadV(y, b));
+				break;
+			case 0x9:
+				skip = _mm256_xor_si256(_mm256_cmpeq_epi8(LoadV(x, b), LoadV(y, b)), _mm256_set1_epi8(-1));
+				break;
+			case 0x6:
+				StoreV(x, b, m8, _mm256_set1_epi8(static_cast<char>(kk)));
+				break;
+			case 0x7:
+				StoreV(x, b, m8, _mm256_add_epi8(LoadV(x, b), _mm256_set1_epi8(static_cast<char>(kk))));
+				break;
+			case 0x8:
+				switch (op & 0x000Fu)
+				{
+				case 0x0:
+					StoreV(x, b, m8, LoadV(y, b));
+					break;
+				case 0x1:
+					StoreV(x, b, m8, _mm256_or_si256(LoadV(x, b), LoadV(y, b)));
+					break;
+				case 0x2:
+					StoreV(x, b, m8, _mm256_and_si256(LoadV(x, b), LoadV(y, b)));
+					break;
+				case 0x3:
+					StoreV(x, b, m8, _mm256_xor_si256(LoadV(x, b), LoadV(y, b)));
+					break;
+				case 0x4:
+				{
+					__m256i vx = LoadV(x, b);
+					__m256i result = _mm256_add_epi8(vx, LoadV(y, b));
+					StoreV(0xF, b, m8, _mm256_and_si256(Greater(vx, result), one));
+					StoreV(x, b, m8, result);
+				}
+				break;
+				case 0x5:
+					StoreV(0xF, b, m8, _mm256_and_si256(Greater(LoadV(x, b), LoadV(y, b)), one));
+					StoreV(x, b, m8, _mm256_sub_epi8(LoadV(x, b), LoadV(y, b)));
+					break;
+				case 0x6:
+					StoreV(0xF, b, m8, _mm256_and_si256(LoadV(s, b), one));
+					StoreV(x, b, m8, _mm256_and_si256(_mm256_srli_epi16(LoadV(s, b), 1), _mm256_set1_epi8(0x7F)));
+					break;
+				case 0x7:
+					StoreV(0xF, b, m8, _mm256_and_si256(Greater(LoadV(y, b), LoadV(x, b)), one));
+					StoreV(x, b, m8, _mm256_sub_epi8(LoadV(y, b), LoadV(x, b)));
+					break;
+				case 0xE:
+					StoreV(0xF, b, m8, _mm256_and_si256(_mm256_srli_epi16(LoadV(s, b), 7), one));
+					StoreV(x, b, m8, _mm256_add_epi8(LoadV(s, b), LoadV(s, b)));
+					break;
+				}
+				break;
+			case 0xA:
+				for (int h = 0; h < 2; h++)
+				{
+					Store16(&index[b + 16 * h], _mm256_set1_epi16(static_cast<short>(nnn)), m16[h]);
+				}
+				break;
+			case 0xB:
+			{
+				jump = true;
+				__m256i v0 = LoadV(j, b);
+				target[0] = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(v0)), _mm256_set1_epi16(static_cast<short>(nnn)));
+				target[1] = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(v0, 1)), _mm256_set1_epi16(static_cast<short>(nnn)));
+			}
+			break;
+			case 0xF:
+				switch (kk)
+				{
+				case 0x07:
+					StoreV(x, b, m8, Load8(&delayTimer[b]));
+					break;
+				case 0x15:
+					Store8(&delayTimer[b], LoadV(x, b), m8);
+					break;
+				case 0x18:
+					Store8(&soundTimer[b], LoadV(x, b), m8);
+					break;
+				case 0x1E:
+				{
+					__m256i vx = LoadV(x, b);
+					__m256i add[2] = {_mm256_cvtepu8_epi16(_mm256_castsi256_si128(vx)),
+									  _mm256_cvtepu8_epi16(_mm256_extracti128_si256(vx, 1))};
+					for (int h = 0; h < 2; h++)
+					{
+						__m256i *slot = reinterpret_cast<__m256i *>(&index[b + 16 * h]);
+						Store16(&index[b + 16 * h], _mm256_add_epi16(_mm256_loadu_si256(slot), add[h]), m16[h]);
+					}
+				}
+				break;
+				}
+				break;
+			}
+
+			skips += __builtin_popcount(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_and_si256(skip, m8))));
+
+			__m256i skip16[2] = {_mm256_cvtepi8_epi16(_mm256_castsi256_si128(skip)),
+								 _mm256_cvtepi8_epi16(_mm256_extracti128_si256(skip, 1))};
+
+			for (int h = 0; h < 2; h++)
+			{
+				__m256i *slot = reinterpret_cast<__m256i *>(&pc[b + 16 * h]);
+				__m256i next = jump ? target[h] : _mm256_add_epi16(_mm256_add_epi16(_mm256_loadu_si256(slot), two), _mm256_and_si256(skip16[h], two));
+				Store16(&pc[b + 16 * h], next, m16[h]);
+			}
+		}
+
+		return skips;
+	}
+
+	// Tick the timers of every lane: in the arrays for attached lanes (the
+	// others' slots are stale and ignored), in their Chip8 for detached ones.
+	CHIP8_AVX2
+	void TickTimers()
+	{
+		__m256i const one = _mm256_set1_epi8(1);
+
+		for (size_t b = 0; b < padded; b += BLOCK)
+		{
+			Store8(&delayTimer[b], _mm256_subs_epu8(Load8(&delayTimer[b]), one), _mm256_set1_epi8(-1));
+			Store8(&soundTimer[b], _mm256_subs_epu8(Load8(&soundTimer[b]), one), _mm256_set1_epi8(-1));
+
+			uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_andnot_si256(Load8(&mask[b]), Load8(&live[b]))));
+			while (bits)
+			{
+				Lane(b + __builtin_ctz(bits)).TickTimers();
+				bits &= bits - 1;
+			}
+		}
+	}
+
+	CHIP8_AVX2
+	__m256i LoadV(unsigned int r, size_t b)
+	{
+		return Load8(&V(r)[b]);
+	}
+
+	CHIP8_AVX2
+	void StoreV(unsigned int r, size_t b, __m256i m, __m256i value)
+	{
+		Store8(&V(r)[b], value, m);
+	}
+
+	// unsigned a > c
+	CHIP8_AVX2
+	static __m256i Greater(__m256i a, __m256i c)
+	{
+		return _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, c), c), _mm256_set1_epi8(-1));
+	}
+
+	CHIP8_AVX2
+	static __m256i Load8(uint8_t const *p)
+	{
+		return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));
+	}
+
+	CHIP8_AVX2
+	static void Store8(uint8_t *p, __m256i value, __m256i m)
+	{
+		__m256i *slot = reinterpret_cast<__m256i *>(p);
+		_mm256_storeu_si256(slot, _mm256_blendv_epi8(_mm256_loadu_si256(slot), value, m));
+	}
+
+	CHIP8_AVX2
+	static void Store16(uint16_t *p, __m256i value, __m256i m)
+	{
+		__m256i *slot = reinterpret_cast<__m256i *>(p);
+		_mm256_storeu_si256(slot, _mm256_blendv_epi8(_mm256_loadu_si256(slot), value, m));
+	}
+
+#endif
+
+	Fleet &fleet;
+	size_t lanes;
+	size_t padded;
+	bool vectorized = false;
+
+	std::vector<uint8_t> v; // v[r * padded + lane] = Vr of lane
+	std::vector<uint16_t> pc;
+	std::vector<uint16_t> index;
+	std::vector<uint16_t> opcode;
+	std::vector<uint8_t> delayTimer;
+	std::vector<uint8_t> soundTimer;
+	std::vector<uint8_t> mask;	  // 0xFF for attached lanes
+	std::vector<uint8_t> live;	  // 0xFF for real lanes, 0 for padding
+	std::vector<uint32_t> resume; // steps of the current chunk a detached lane has run
+	size_t attached = 0;
+	size_t leader = 0; // an attached lane
+	uint16_t groupPc = 0;
+	uint8_t written[MEMORY_SIZE];
+};
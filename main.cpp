@@ -1,30 +1,163 @@
 #include <iostream>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
 #include <iomanip>
 #include <stdio.h>
+#include <cmath>
+#include <algorithm>
 #include "platform.cpp"
 #include "chip8.cpp"
+#include "rewind.cpp"
+#include "movie.cpp"
+#include "registry.cpp"
+#include "handoff.cpp"
+#include "input.cpp"
+#include "runahead.cpp"
+#include "netplay.cpp"
 
-const int VIDEO_WIDTH = 64;
-const int VIDEO_HEIGHT = 32;
+// the window starts at the low resolution size; high resolution ROMs draw
+// into it at half the scale
+const int VIDEO_WIDTH = SCREEN_WIDTH;
+const int VIDEO_HEIGHT = SCREEN_HEIGHT;
 
 int main(int argc, char **argv)
 {
-    if (argc != 4)
+    if (argc < 4)
     {
-        std::cerr << "Usage: " << argv[0] << " <Scale> <Delay> <ROM>\n";
+        std::cerr << "Usage: " << argv[0] << " <Scale> <InstructionsPerSecond> <ROM> [-s <seed>] [-r <movie>] [-p <profile>] [-k <layout>] [-a <frames>] [-net <local port> <remote host> <remote port>]\n";
         std::exit(EXIT_FAILURE);
     }
 
     int videoScale = std::stoi(argv[1]);
-    int cycleDelay = std::stoi(argv[2]);
+    double instructionsPerSecond = std::stod(argv[2]);
     char const *romFilename = argv[3];
 
-    Platform platform("CHIP-8 Emulator", VIDEO_WIDTH * videoScale, VIDEO_HEIGHT * videoScale, VIDEO_WIDTH, VIDEO_HEIGHT);
+    // a recorded session is always seeded, from the clock unless given
+    uint64_t seed = std::chrono::system_clock::now().time_since_epoch().count();
+    char const *movieFilename = nullptr;
+    char const *profileName = nullptr;
+    char const *keyLayout = DEFAULT_KEY_LAYOUT;
+    unsigned int runAheadFrames = 0;
+    bool seeded = false;
+    char const *remoteHost = nullptr;
+    uint16_t localPort = 0;
+    uint16_t remotePort = 0;
 
-    Chip8 chip8;
+    for (int i = 4; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "-s" && i + 1 < argc)
+        {
+            seed = std::stoull(argv[++i]);
+            seeded = true;
+        }
+        else if (arg == "-r" && i + 1 < argc)
+        {
+            movieFilename = argv[++i];
+        }
+        else if (arg == "-p" && i + 1 < argc)
+        {
+            profileName = argv[++i];
+        }
+        else if (arg == "-k" && i + 1 < argc)
+        {
+            keyLayout = argv[++i];
+        }
+        else if (arg == "-a" && i + 1 < argc)
+        {
+            runAheadFrames = std::stoul(argv[++i]);
+        }
+        else if (arg == "-net" && i + 3 < argc)
+        {
+            localPort = static_cast<uint16_t>(std::stoul(argv[++i]));
+            remoteHost = argv[++i];
+            remotePort = static_cast<uint16_t>(std::stoul(argv[++i]));
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " <Scale> <InstructionsPerSecond> <ROM> [-s <seed>] [-r <movie>] [-p <profile>] [-k <layout>] [-a <frames>] [-net <local port> <remote host> <remote port>]\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    // both peers must run the same machine from the same seed
+    if (remoteHost && (!seeded || movieFilename || runAheadFrames > 0))
+    {
+        std::cerr << "-net needs the seed both players use (-s) and works without -r and -a\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (instructionsPerSecond < 0)
+    {
+        std::cerr << "InstructionsPerSecond must not be negative\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    Chip8 chip8(seed);
+    Rewind rewind;
+
+    // the ROM database supplies quirks and, for speed 0, the speed
+    RomRegistry registry;
+    registry.LoadDatabase(RomDatabasePath());
+
+    RomConfig const *config;
+    RomError error = registry.Load(chip8, romFilename, &config);
+    if (error != RomError::None)
+    {
+        std::cerr << romFilename << ": " << RomErrorString(error) << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    // an explicit profile replaces the database's quirks
+    if (profileName && !FindQuirkProfile(profileName, chip8.quirks))
+    {
+        std::cerr << "unknown quirk profile " << profileName << " (legacy, vip, chip48, schip)\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    std::string title = "CHIP-8 Emulator";
+    if (config && !config->title.empty())
+    {
+        title += " - " + config->title;
+    }
+
+    Platform platform(title.c_str(), VIDEO_WIDTH * videoScale, VIDEO_HEIGHT * videoScale, VIDEO_WIDTH, VIDEO_HEIGHT, videoScale);
+
+    if (!platform.MapKeys(keyLayout))
+    {
+        std::cerr << "a key layout names the keys for keypad 0-F, e.g. " << DEFAULT_KEY_LAYOUT << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+
+    // timers tick every cyclesPerFrame instructions, keep that close to 60 Hz
+    if (instructionsPerSecond > 0)
+    {
+        chip8.cyclesPerFrame = std::max(1L, std::lround(instructionsPerSecond / TIMER_HZ));
+    }
+    else
+    {
+        instructionsPerSecond = chip8.cyclesPerFrame * TIMER_HZ;
+    }
 
-    chip8.LoadROM(romFilename);
+    MovieRecorder recorder(chip8, seed);
+
+    std::unique_ptr<Netplay> netplay;
+    if (remoteHost)
+    {
+        netplay = std::make_unique<Netplay>(chip8);
+        if (!netplay->Open(localPort, remoteHost, remotePort))
+        {
+            std::cerr << "cannot reach " << remoteHost << ":" << remotePort << " from UDP port " << localPort << "\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    // idle loops cost nothing to emulate; while the ROM waits for a key the
+    // emulation thread waits for input instead of sleeping
+    chip8.skipIdle = true;
 
     // for deletion later
     // for (long i = 0x200; i <= 0x400; i += 2)
@@ -34,29 +167,218 @@ int main(int argc, char **argv)
     //     // std::cout << std::hex << chip8.memory[i] << std::endl;
     // }
 
-    int videoPitch = sizeof(chip8.screen[0]) * VIDEO_WIDTH;
-    // int videoPitch = 4 * 64;
-
-    auto lastCycleTime = std::chrono::high_resolution_clock::now();
-    bool quit = false;
+    // The emulation thread owns chip8, the rewind history, the recorder and
+    // the netplay session; this thread owns SDL. See handoff.cpp.
+    TripleBuffer<VideoFrame> frames;
+    InputQueue input;
+    RunAhead ahead(runAheadFrames);
+    std::atomic<bool> quit{false};
+    std::atomic<bool> rewinding{false};
+    std::atomic<bool> overlayVisible{false};
 
     chip8.OP_00E0();
-    while (!quit)
+
+    // Frame-paced loop: every 1/60 s run the instructions owed since the last
+    // frame, publish it, then sleep until the next deadline.
+    std::thread emulation([&]()
+                          {
+        auto const framePeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / TIMER_HZ));
+        double const cyclesPerHostFrame = instructionsPerSecond / TIMER_HZ;
+
+        auto nextFrame = std::chrono::steady_clock::now();
+        uint64_t frameStart = InputQueue::Now();
+        double owedCycles = 0;
+        uint64_t forwardCycles = 0;
+        uint64_t generation = 0;
+        uint8_t localKeys[sizeof(chip8.keypad)] = {};
+
+        while (!quit.load(std::memory_order_relaxed))
+        {
+            // this batch stands for the host time since the last one
+            uint64_t frameEnd = InputQueue::Now();
+            bool back = !netplay && rewinding.load(std::memory_order_relaxed);
+
+            if (netplay)
+            {
+                // whole frames, with the keys as held at the frame start
+                ApplyInput(localKeys, frameEnd, input);
+                forwardCycles += netplay->Tick(KeypadMask(localKeys)) * chip8.cyclesPerFrame;
+
+                if (netplay->Mismatched())
+                {
+                    std::cerr << "the other player runs another ROM, speed or quirk profile\n";
+                    quit.store(true, std::memory_order_relaxed);
+                }
+            }
+            else if (back)
+            {
+                // step back one frame per host frame, keeping the keys as held now
+                uint8_t keys[sizeof(chip8.keypad)];
+                memcpy(keys, chip8.keypad, sizeof(keys));
+                ApplyInput(keys, frameEnd, input);
+
+                rewind.StepBack(chip8);
+                memcpy(chip8.keypad, keys, sizeof(keys));
+                recorder.Rewound(chip8);
+                recorder.Record(chip8);
+            }
+            else
+            {
+                owedCycles += cyclesPerHostFrame;
+                uint64_t batch = static_cast<uint64_t>(owedCycles);
+                owedCycles -= batch;
+
+                RunWithInput(chip8, batch, frameStart, frameEnd, input, [&recorder](Chip8 const &chip8)
+                             { recorder.Record(chip8); });
+                rewind.Push(chip8);
+                forwardCycles += batch;
+            }
+
+            frameStart = frameEnd;
+
+            VideoFrame &frame = frames.Back();
+            bool drew = chip8.screenDirty;
+
+            auto capture = [&frame](Chip8 const &shown)
+            {
+                memcpy(frame.screen, shown.screen, sizeof(frame.screen));
+                frame.width = shown.ScreenWidth();
+                frame.height = shown.ScreenHeight();
+            };
+
+            // with run-ahead, show where the current keys lead
+            if (ahead.Frames() > 0 && !back)
+            {
+                ahead.Preview(chip8, [&](Chip8 const &future)
+                              {
+                                  drew = drew || future.screenDirty;
+                                  capture(future); });
+            }
+            else
+            {
+                capture(chip8);
+            }
+
+            if (drew)
+            {
+                generation++;
+                chip8.screenDirty = false;
+            }
+
+            frame.generation = generation;
+            frame.cycles = forwardCycles;
+            frame.idleCycles = chip8.idleCycles;
+
+            if constexpr (ProfileSink::enabled)
+            {
+                if (overlayVisible.load(std::memory_order_relaxed))
+                {
+                    frame.heatmap.assign(chip8.profile.Heatmap(), chip8.profile.Heatmap() + PROFILE_PC_SIZE);
+                }
+                else
+                {
+                    frame.heatmap.clear();
+                }
+            }
+
+            frames.Publish();
+            platform.NotifyFrame();
+
+            auto now = std::chrono::steady_clock::now();
+            nextFrame += framePeriod;
+
+            // if we fell more than a few frames behind, resync instead of bursting
+            if (now - nextFrame > 4 * framePeriod)
+            {
+                nextFrame = now;
+            }
+
+            // a key press ends the wait early and runs the next frame at once
+            if (!back && !netplay && chip8.WaitingForKey())
+            {
+                input.WaitForEvent(nextFrame);
+            }
+            else
+            {
+                std::this_thread::sleep_until(nextFrame);
+            }
+        } });
+
+    // SDL thread: sleep until input arrives or the emulation thread has a
+    // frame, pass the keys on and show the newest frame.
+    uint64_t shown = ~0ull;
+    uint64_t framesSkipped = 0;
+    auto reportStart = std::chrono::steady_clock::now();
+    uint64_t reportCycles = 0;
+    uint64_t reportIdle = 0;
+
+    while (!quit.load(std::memory_order_relaxed))
     {
-        quit = platform.ProcessInput(chip8.keypad);
+        platform.WaitForEvent(100);
+
+        if (platform.ProcessInput(input))
+        {
+            quit.store(true, std::memory_order_relaxed);
+        }
+
+        rewinding.store(platform.rewinding, std::memory_order_relaxed);
+        overlayVisible.store(platform.overlayVisible, std::memory_order_relaxed);
+
+        bool fresh = frames.Acquire();
+        VideoFrame const &frame = frames.Front();
 
-        auto currentTime = std::chrono::high_resolution_clock::now();
-        float dt = std::chrono::duration<float, std::chrono::milliseconds::period>(currentTime - lastCycleTime).count();
+        if constexpr (ProfileSink::enabled)
+        {
+            if (fresh && platform.overlayVisible && !frame.heatmap.empty())
+            {
+                platform.SetOverlay(frame.heatmap.data(), 64);
+            }
+        }
 
-        if (dt > cycleDelay)
+        // a new frame that leaves the screen as it was is not uploaded
+        bool dirty = frame.generation != shown;
+        if (fresh && !dirty)
         {
-            lastCycleTime = currentTime;
+            framesSkipped++;
+        }
 
-            chip8.Cycle();
+        platform.Present(frame.screen[0], frame.screen[1], frame.width, frame.height, dirty);
+        shown = frame.generation;
 
-            platform.Update(chip8.screen, videoPitch);
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - reportStart).count();
+
+        if (elapsed >= 1.0)
+        {
+            double actual = (frame.cycles - reportCycles) / elapsed;
+            double idle = frame.cycles > reportCycles ? static_cast<double>(frame.idleCycles - reportIdle) / (frame.cycles - reportCycles) : 0.0;
+            std::cerr << "speed: " << std::fixed << std::setprecision(0) << actual << " / " << instructionsPerSecond
+                      << " instructions/s (" << std::setprecision(1) << 100.0 * actual / instructionsPerSecond << "%), idle "
+                      << 100.0 * idle << "%, frames presented " << platform.framesPresented << " skipped " << framesSkipped << "\n";
+
+            reportStart = now;
+            reportCycles = frame.cycles;
+            reportIdle = frame.idleCycles;
         }
     }
 
+    emulation.join();
+
+    if (netplay)
+    {
+        RollbackStats const &stats = netplay->History().Stats();
+        uint64_t frames = std::max<uint64_t>(1, netplay->History().Frame());
+
+        std::cerr << "netplay: " << frames << " frames, " << stats.rollbacks << " rollbacks re-simulating "
+                  << stats.resimulatedFrames << " frames (" << std::setprecision(1) << stats.resimulationSeconds * 1e6 / frames
+                  << " us per frame), " << netplay->stalls << " stalls, " << netplay->desyncs << " desyncs\n";
+    }
+
+    if (movieFilename && !SaveMovie(movieFilename, recorder.Finish(chip8)))
+    {
+        std::cerr << "cannot write movie " << movieFilename << "\n";
+        return EXIT_FAILURE;
+    }
+
     return 0;
 }
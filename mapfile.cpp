@@ -0,0 +1,113 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file. The pages come straight from the
+// OS file cache, so reading a file costs no buffer allocation and no copy.
+// An empty file opens successfully with Data() == nullptr.
+
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	explicit MappedFile(char const *filename) { Open(filename); }
+	~MappedFile() { Close(); }
+
+	MappedFile(MappedFile const &) = delete;
+	MappedFile &operator=(MappedFile const &) = delete;
+
+	bool Open(char const *filename)
+	{
+		Close();
+
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		LARGE_INTEGER length;
+		bool ok = GetFileSizeEx(file, &length) != 0;
+		size = ok ? static_cast<size_t>(length.QuadPart) : 0;
+
+		if (ok && size > 0)
+		{
+			HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping)
+			{
+				data = static_cast<uint8_t const *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				CloseHandle(mapping);
+			}
+			ok = data != nullptr;
+		}
+		CloseHandle(file);
+#else
+		int fd = ::open(filename, O_RDONLY);
+		if (fd < 0)
+		{
+			return false;
+		}
+
+		struct stat info;
+		bool ok = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+		size = ok ? static_cast<size_t>(info.st_size) : 0;
+
+		if (ok && size > 0)
+		{
+			void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			data = address != MAP_FAILED ? static_cast<uint8_t const *>(address) : nullptr;
+			ok = data != nullptr;
+		}
+		::close(fd);
+#endif
+
+		if (!ok)
+		{
+			data = nullptr;
+			size = 0;
+		}
+		opened = ok;
+		return ok;
+	}
+
+	void Close()
+	{
+		if (data)
+		{
+#if defined(_WIN32)
+			UnmapViewOfFile(data);
+#else
+			munmap(const_cast<uint8_t *>(data), size);
+#endif
+		}
+
+		data = nullptr;
+		size = 0;
+		opened = false;
+	}
+
+	bool IsOpen() const { return opened; }
+	uint8_t const *Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	uint8_t const *data = nullptr;
+	size_t size = 0;
+	bool opened = false;
+};
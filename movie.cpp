@@ -0,0 +1,235 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include "chip8.cpp"
+#include "savestate.cpp"
+
+// Input movies: everything needed to reproduce a session deterministically.
+//
+// A machine created with Chip8(seed) is fully determined by its ROM, the
+// seed, cyclesPerFrame, quirks and the keypad state at every cycle. A movie
+// records the first four in its header and the keypad as a list of (cycle, 16-bit
+// key mask) changes, plus the session length and a hash of the final state so
+// a replay can check it ended up in the same place.
+//
+// File layout (little endian):
+//   "C8MV", uint16 version, uint64 seed, uint64 ROM hash, uint32 cyclesPerFrame,
+//   uint32 quirks (absent in version 1 movies, which ran PROFILE_LEGACY),
+//   uint64 length in cycles, uint64 final state hash, varint event count,
+//   then per event: varint cycles since the previous event, uint16 key mask
+
+const uint16_t MOVIE_VERSION = 2;
+
+struct MovieEvent
+{
+	uint64_t cycle;
+	uint16_t keys; // bit n set while key n is held
+};
+
+struct Movie
+{
+	uint64_t seed = 0;
+	uint64_t romHash = 0;
+	uint32_t cyclesPerFrame = DEFAULT_CYCLES_PER_FRAME;
+	uint32_t quirks = PROFILE_LEGACY;
+	uint64_t length = 0;
+	uint64_t finalHash = 0;
+	std::vector<MovieEvent> events;
+};
+
+inline uint16_t KeypadMask(uint8_t const *keypad)
+{
+	uint16_t mask = 0;
+	for (int key = 0; key < 16; key++)
+	{
+		mask |= keypad[key] ? 1u << key : 0u;
+	}
+	return mask;
+}
+
+inline void SetKeypad(uint8_t *keypad, uint16_t mask)
+{
+	for (int key = 0; key < 16; key++)
+	{
+		keypad[key] = (mask >> key) & 1u;
+	}
+}
+
+// Records a session from a freshly constructed, ROM-loaded machine. Call
+// Record after every input poll (before running), Rewound after the machine
+// was restored to an earlier cycle and Record again once the keys held now
+// are back in its keypad, and Finish at the end.
+class MovieRecorder
+{
+public:
+	MovieRecorder(Chip8 const &chip8, uint64_t seed)
+	{
+		movie.seed = seed;
+		movie.romHash = chip8.loadedHash;
+		movie.cyclesPerFrame = chip8.cyclesPerFrame;
+		movie.quirks = chip8.quirks;
+	}
+
+	void Record(Chip8 const &chip8)
+	{
+		uint16_t keys = KeypadMask(chip8.keypad);
+		if (keys == last)
+		{
+			return;
+		}
+
+		if (!movie.events.empty() && movie.events.back().cycle == chip8.cycles)
+		{
+			movie.events.back().keys = keys;
+		}
+		else
+		{
+			movie.events.push_back({chip8.cycles, keys});
+		}
+		last = keys;
+	}
+
+	// Forget input from chip8.cycles on; the session continues from there.
+	void Rewound(Chip8 const &chip8)
+	{
+		while (!movie.events.empty() && movie.events.back().cycle >= chip8.cycles)
+		{
+			movie.events.pop_back();
+		}
+		last = movie.events.empty() ? 0 : movie.events.back().keys;
+	}
+
+	Movie const &Finish(Chip8 const &chip8)
+	{
+		Record(chip8);
+		movie.length = chip8.cycles;
+		movie.finalHash = StateHash(chip8);
+		return movie;
+	}
+
+private:
+	Movie movie;
+	uint16_t last = 0;
+};
+
+bool SaveMovie(char const *filename, Movie const &movie)
+{
+	std::vector<uint8_t> out;
+	StateWriter w(out);
+
+	w.Bytes("C8MV", 4);
+	w.U16(MOVIE_VERSION);
+	w.U64(movie.seed);
+	w.U64(movie.romHash);
+	w.U32(movie.cyclesPerFrame);
+	w.U32(movie.quirks);
+	w.U64(movie.length);
+	w.U64(movie.finalHash);
+	w.Varint(movie.events.size());
+
+	uint64_t cycle = 0;
+	for (MovieEvent const &event : movie.events)
+	{
+		w.Varint(event.cycle - cycle);
+		w.U16(event.keys);
+		cycle = event.cycle;
+	}
+
+	FILE *file = std::fopen(filename, "wb");
+	if (!file)
+	{
+		return false;
+	}
+
+	bool ok = std::fwrite(out.data(), 1, out.size(), file) == out.size();
+	return std::fclose(file) == 0 && ok;
+}
+
+bool LoadMovie(char const *filename, Movie &movie)
+{
+	std::vector<uint8_t> data;
+	FILE *file = std::fopen(filename, "rb");
+	if (!file)
+	{
+		return false;
+	}
+
+	uint8_t buffer[4096];
+	size_t count;
+	while ((count = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		data.insert(data.end(), buffer, buffer + count);
+	}
+	std::fclose(file);
+
+	StateReader r(data.data(), data.size());
+	char magic[4];
+	uint16_t version;
+	uint64_t events;
+
+	movie.quirks = PROFILE_LEGACY;
+	if (!r.Bytes(magic, 4) || memcmp(magic, "C8MV", 4) != 0 ||
+		!r.Uint(version) || version < 1 || version > MOVIE_VERSION ||
+		!r.Uint(movie.seed) || !r.Uint(movie.romHash) || !r.Uint(movie.cyclesPerFrame) ||
+		(version >= 2 && !r.Uint(movie.quirks)) || !r.Uint(movie.length) || !r.Uint(movie.finalHash) || !r.Varint(events))
+	{
+		return false;
+	}
+
+	movie.events.clear();
+	uint64_t cycle = 0;
+	for (uint64_t i = 0; i < events; i++)
+	{
+		uint64_t delta;
+		MovieEvent event;
+
+		if (!r.Varint(delta) || !r.Uint(event.keys))
+		{
+			return false;
+		}
+
+		cycle += delta;
+		event.cycle = cycle;
+		movie.events.push_back(event);
+	}
+
+	return r.AtEnd();
+}
+
+// Play movie back on chip8, which must be a fresh Chip8(movie.seed) with the
+// movie's ROM loaded. run(n) executes n cycles, so any backend can replay.
+// Returns true if the session ends in the recorded final state.
+template <typename Runner>
+bool ReplayMovie(Chip8 &chip8, Movie const &movie, Runner &&run)
+{
+	chip8.cyclesPerFrame = movie.cyclesPerFrame;
+	chip8.quirks = movie.quirks;
+	size_t next = 0;
+
+	for (;;)
+	{
+		while (next < movie.events.size() && movie.events[next].cycle <= chip8.cycles)
+		{
+			SetKeypad(chip8.keypad, movie.events[next].keys);
+			next++;
+		}
+
+		if (chip8.cycles >= movie.length)
+		{
+			break;
+		}
+
+		uint64_t end = next < movie.events.size() ? std::min(movie.length, movie.events[next].cycle) : movie.length;
+		run(end - chip8.cycles);
+	}
+
+	return chip8.loadedHash == movie.romHash && StateHash(chip8) == movie.finalHash;
+}
+
+inline bool ReplayMovie(Chip8 &chip8, Movie const &movie)
+{
+	return ReplayMovie(chip8, movie, [&chip8](uint64_t n)
+					   { chip8.RunCycles(n); });
+}
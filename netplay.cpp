@@ -0,0 +1,465 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "chip8.cpp"
+#include "savestate.cpp"
+#include "movie.cpp"
+
+// Rollback netplay for two players sharing one keypad.
+//
+// Both peers run the same ROM, seed and speed. Every frame each peer runs
+// with its own keys ORed with a prediction of the other's (the last keys it
+// received) and saves the state at the frame start. When the real remote
+// keys for a frame arrive and differ from the prediction, Rollback loads
+// that frame's state and runs the frames since again, so neither player
+// waits for the other's input and a misprediction costs a few frames of
+// re-simulation. A peer more than WINDOW frames ahead of the remote input it
+// has stalls until it catches up.
+//
+// Packets (UDP, little endian) carry every local input the peer has not
+// acknowledged yet, so a lost packet is repaired by the next one:
+//   "C8NP", uint64 ROM image hash, uint32 cyclesPerFrame, uint32 quirks,
+//   uint64 remote frames received (the ack), uint64 first frame,
+//   uint16 count, count x uint16 keys,
+//   uint64 confirmed frame + 1 (0 if none), uint64 its state hash
+// The peers compare the state hashes of frames both have confirmed and
+// count any difference as a desync.
+//
+// UdpLink can hold back and drop outgoing packets to simulate latency and
+// loss on localhost.
+
+class UdpLink
+{
+public:
+	UdpLink() = default;
+	~UdpLink() { Close(); }
+
+	UdpLink(UdpLink const &) = delete;
+	UdpLink &operator=(UdpLink const &) = delete;
+
+	// Bind localPort and send to remoteHost:remotePort.
+	bool Open(uint16_t localPort, char const *remoteHost, uint16_t remotePort)
+	{
+		Close();
+
+#if defined(_WIN32)
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+		{
+			return false;
+		}
+		started = true;
+#endif
+
+		addrinfo hints{};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		addrinfo *found = nullptr;
+		if (getaddrinfo(remoteHost, nullptr, &hints, &found) != 0 || !found)
+		{
+			return false;
+		}
+		memcpy(&remote, found->ai_addr, sizeof(remote));
+		remote.sin_port = htons(remotePort);
+		freeaddrinfo(found);
+
+		handle = socket(AF_INET, SOCK_DGRAM, 0);
+		if (handle == INVALID)
+		{
+			return false;
+		}
+
+		sockaddr_in local{};
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+		local.sin_port = htons(localPort);
+
+#if defined(_WIN32)
+		u_long nonBlocking = 1;
+		bool ok = ioctlsocket(handle, FIONBIO, &nonBlocking) == 0;
+#else
+		bool ok = fcntl(handle, F_SETFL, fcntl(handle, F_GETFL, 0) | O_NONBLOCK) == 0;
+#endif
+		ok = ok && bind(handle, reinterpret_cast<sockaddr const *>(&local), sizeof(local)) == 0;
+
+		if (!ok)
+		{
+			Close();
+		}
+		return ok;
+	}
+
+	void Close()
+	{
+		if (handle != INVALID)
+		{
+#if defined(_WIN32)
+			closesocket(handle);
+#else
+			::close(handle);
+#endif
+			handle = INVALID;
+		}
+
+#if defined(_WIN32)
+		if (started)
+		{
+			WSACleanup();
+			started = false;
+		}
+#endif
+	}
+
+	// Hold every outgoing packet back for latency and drop each with
+	// probability loss.
+	void Simulate(std::chrono::milliseconds latency, double loss, uint64_t seed)
+	{
+		this->latency = latency;
+		this->loss = loss;
+		random.seed(seed);
+	}
+
+	void Send(std::vector<uint8_t> const &packet)
+	{
+		sent++;
+		if (loss > 0 && std::uniform_real_distribution<double>(0, 1)(random) < loss)
+		{
+			dropped++;
+			return;
+		}
+
+		pending.push_back({std::chrono::steady_clock::now() + latency, packet});
+		Flush();
+	}
+
+	// Put the held back packets that are due on the wire.
+	void Flush()
+	{
+		auto now = std::chrono::steady_clock::now();
+
+		while (!pending.empty() && pending.front().due <= now)
+		{
+			std::vector<uint8_t> const &bytes = pending.front().bytes;
+			sendto(handle, reinterpret_cast<char const *>(bytes.data()), static_cast<int>(bytes.size()), 0, reinterpret_cast<sockaddr const *>(&remote), sizeof(remote));
+			pending.pop_front();
+		}
+	}
+
+	// Next received packet, if any; never blocks.
+	bool Receive(std::vector<uint8_t> &packet)
+	{
+		packet.resize(MAX_PACKET);
+		auto size = recv(handle, reinterpret_cast<char *>(packet.data()), MAX_PACKET, 0);
+		if (size <= 0)
+		{
+			return false;
+		}
+
+		packet.resize(static_cast<size_t>(size));
+		received++;
+		return true;
+	}
+
+	static constexpr int MAX_PACKET = 1500;
+
+	uint64_t sent = 0;
+	uint64_t dropped = 0; // by Simulate's loss
+	uint64_t received = 0;
+
+private:
+#if defined(_WIN32)
+	typedef SOCKET Handle;
+	static constexpr Handle INVALID = INVALID_SOCKET;
+	bool started = false;
+#else
+	typedef int Handle;
+	static constexpr Handle INVALID = -1;
+#endif
+
+	struct Delayed
+	{
+		std::chrono::steady_clock::time_point due;
+		std::vector<uint8_t> bytes;
+	};
+
+	Handle handle = INVALID;
+	sockaddr_in remote{};
+	std::chrono::milliseconds latency{0};
+	double loss = 0;
+	std::minstd_rand random;
+	std::deque<Delayed> pending;
+};
+
+struct RollbackStats
+{
+	uint64_t rollbacks = 0;
+	uint64_t resimulatedFrames = 0;
+	uint64_t longestRollback = 0; // frames
+	double resimulationSeconds = 0;
+};
+
+// The frame history and re-simulation, independent of the transport.
+class Rollback
+{
+public:
+	static constexpr uint64_t WINDOW = 30; // frames a peer may run ahead of the remote input
+
+	explicit Rollback(Chip8 &chip8) : chip8(chip8), states(WINDOW + 1) {}
+
+	uint64_t Frame() const { return frame; }			  // next frame to run
+	uint64_t RemoteFrames() const { return remote.size(); } // frames whose remote keys are known
+	bool CanAdvance() const { return frame < remote.size() + WINDOW; }
+
+	std::vector<uint16_t> const &LocalKeys() const { return local; }
+	std::vector<uint64_t> const &ConfirmedHashes() const { return confirmed; }
+	RollbackStats const &Stats() const { return stats; }
+
+	// Run frame Frame() with the local keys and the predicted remote ones.
+	void Advance(uint16_t keys)
+	{
+		local.push_back(keys);
+		SaveState(chip8, states[frame % states.size()]);
+		Run(frame);
+		frame++;
+		Confirm();
+	}
+
+	// The remote keys of frames first to first + count - 1. Frames already
+	// known are skipped. If a frame already run used a wrong prediction, roll
+	// back to it and run the frames since again.
+	void AddRemote(uint64_t first, uint16_t const *keys, size_t count)
+	{
+		uint64_t wrong = frame;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			uint64_t f = first + i;
+			if (f < remote.size())
+			{
+				continue;
+			}
+			if (f > remote.size())
+			{
+				break;
+			}
+
+			remote.push_back(keys[i]);
+			if (f < frame && keys[i] != predicted[f % states.size()])
+			{
+				wrong = std::min(wrong, f);
+			}
+		}
+
+		if (wrong < frame)
+		{
+			Resimulate(wrong);
+		}
+		Confirm();
+	}
+
+private:
+	void Run(uint64_t f)
+	{
+		uint16_t remoteKeys = f < remote.size() ? remote[f] : remote.empty() ? 0 : remote.back();
+		predicted[f % states.size()] = remoteKeys;
+
+		SetKeypad(chip8.keypad, local[f] | remoteKeys);
+		chip8.RunFrame();
+	}
+
+	void Resimulate(uint64_t from)
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		LoadState(chip8, states[from % states.size()]);
+		for (uint64_t f = from; f < frame; f++)
+		{
+			if (f > from)
+			{
+				SaveState(chip8, states[f % states.size()]);
+			}
+			Run(f);
+		}
+
+		stats.rollbacks++;
+		stats.resimulatedFrames += frame - from;
+		stats.longestRollback = std::max(stats.longestRollback, frame - from);
+		stats.resimulationSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Hash the start states that no remote input can change any more.
+	void Confirm()
+	{
+		while (confirmed.size() < frame && confirmed.size() <= remote.size())
+		{
+			std::vector<uint8_t> const &state = states[confirmed.size() % states.size()];
+			confirmed.push_back(Fnv1a(state.data(), state.size()));
+		}
+	}
+
+	Chip8 &chip8;
+	uint64_t frame = 0;
+	std::vector<uint16_t> local;
+	std::vector<uint16_t> remote;
+	std::vector<std::vector<uint8_t>> states; // start of frame f at f % (WINDOW + 1)
+	uint16_t predicted[WINDOW + 1] = {};	  // remote keys frame f ran with
+	std::vector<uint64_t> confirmed;		  // state hash at the start of each confirmed frame
+	RollbackStats stats;
+};
+
+// A Rollback session with the peer at the other end of a UdpLink.
+class Netplay
+{
+public:
+	static constexpr size_t MAX_INPUTS = 256; // per packet
+
+	explicit Netplay(Chip8 &chip8) : chip8(chip8), rollback(chip8) {}
+
+	bool Open(uint16_t localPort, char const *remoteHost, uint16_t remotePort)
+	{
+		return link.Open(localPort, remoteHost, remotePort);
+	}
+
+	UdpLink &Link() { return link; }
+	Rollback const &History() const { return rollback; }
+
+	// Once per host frame: take in the peer's packets, run the next frame
+	// with keys (two if the peer is ahead, none while too far ahead of it or
+	// at frame until) and send the local input. Returns the frames run.
+	unsigned int Tick(uint16_t keys, uint64_t until = UINT64_MAX)
+	{
+		Poll();
+
+		unsigned int wanted = rollback.RemoteFrames() > rollback.Frame() + 1 ? 2 : 1;
+		unsigned int ran = 0;
+
+		while (ran < wanted && rollback.Frame() < until && rollback.CanAdvance())
+		{
+			rollback.Advance(keys);
+			ran++;
+		}
+
+		if (ran == 0 && rollback.Frame() < until)
+		{
+			stalls++;
+		}
+
+		SendInput();
+		link.Flush();
+		return ran;
+	}
+
+	// Both peers have each other's input for the first frames frames.
+	bool Synced(uint64_t frames) const { return rollback.RemoteFrames() >= frames && acked >= frames; }
+
+	// The peer runs another ROM, speed or quirks.
+	bool Mismatched() const { return mismatched; }
+
+	uint64_t stalls = 0;  // host frames spent waiting for the peer
+	uint64_t desyncs = 0; // confirmed frames whose state differs from the peer's
+
+private:
+	void SendInput()
+	{
+		std::vector<uint16_t> const &keys = rollback.LocalKeys();
+		uint64_t first = std::min<uint64_t>(acked, keys.size());
+		size_t count = std::min<size_t>(keys.size() - first, MAX_INPUTS);
+
+		std::vector<uint8_t> packet;
+		StateWriter w(packet);
+		w.Bytes("C8NP", 4);
+		w.U64(chip8.loadedHash);
+		w.U32(chip8.cyclesPerFrame);
+		w.U32(chip8.quirks);
+		w.U64(rollback.RemoteFrames());
+		w.U64(first);
+		w.U16(static_cast<uint16_t>(count));
+		for (size_t i = 0; i < count; i++)
+		{
+			w.U16(keys[first + i]);
+		}
+
+		std::vector<uint64_t> const &hashes = rollback.ConfirmedHashes();
+		w.U64(hashes.size());
+		w.U64(hashes.empty() ? 0 : hashes.back());
+
+		link.Send(packet);
+	}
+
+	void Poll()
+	{
+		std::vector<uint8_t> packet;
+		std::vector<uint16_t> keys;
+
+		while (link.Receive(packet))
+		{
+			StateReader r(packet.data(), packet.size());
+			char magic[4];
+			uint64_t hash, ack, first, confirmedPlusOne, confirmedHash;
+			uint32_t cyclesPerFrame, quirks;
+			uint16_t count;
+
+			if (!r.Bytes(magic, 4) || memcmp(magic, "C8NP", 4) != 0 || !r.Uint(hash) || !r.Uint(cyclesPerFrame) || !r.Uint(quirks) ||
+				!r.Uint(ack) || !r.Uint(first) || !r.Uint(count))
+			{
+				continue;
+			}
+
+			if (hash != chip8.loadedHash || cyclesPerFrame != chip8.cyclesPerFrame || quirks != chip8.quirks)
+			{
+				mismatched = true;
+				continue;
+			}
+
+			keys.resize(count);
+			bool ok = true;
+			for (uint16_t &key : keys)
+			{
+				ok = ok && r.Uint(key);
+			}
+			if (!ok || !r.Uint(confirmedPlusOne) || !r.Uint(confirmedHash))
+			{
+				continue;
+			}
+
+			acked = std::max(acked, ack);
+			rollback.AddRemote(first, keys.data(), keys.size());
+
+			std::vector<uint64_t> const &hashes = rollback.ConfirmedHashes();
+			if (confirmedPlusOne > 0 && confirmedPlusOne <= hashes.size() && hashes[confirmedPlusOne - 1] != confirmedHash)
+			{
+				desyncs++;
+			}
+		}
+	}
+
+	Chip8 &chip8;
+	Rollback rollback;
+	UdpLink link;
+	uint64_t acked = 0; // local frames the peer has received
+	bool mismatched = false;
+};
@@ -0,0 +1,251 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Hot-path profiles, chosen at compile time.
+//
+// NullProfile compiles to nothing. CountingProfile (build with -DCHIP8_PROFILE)
+// counts every instruction the interpreter executes by opcode and by pc, and
+// keeps a histogram of host time per emulated frame in power-of-two
+// microsecond buckets. Each machine counts on its own; when it is destroyed
+// its counts are added to the process totals, which are written at exit to
+// CHIP8_PROFILE_FILE (default chip8-profile.json) as JSON, or as CSV if the
+// name ends in .csv. Opcodes are reported by family (high nibble) and by the
+// leaf handler the dispatch tables select, named by HandlerName() in
+// chip8.cpp. The pc heatmap covers the first PROFILE_PC_SIZE bytes.
+//
+// Translated code (jit.cpp) and lockstep's vector steps do not go through
+// Chip8::Step(), so only interpreted instructions are counted.
+
+const unsigned int PROFILE_PC_SIZE = 0x1000;
+const unsigned int PROFILE_FRAME_BUCKETS = 24;
+
+char const *HandlerName(uint16_t opcode);
+
+struct NullProfile
+{
+	static constexpr bool enabled = false;
+
+	void Instruction(uint16_t, uint16_t) {}
+	void Frame() {}
+	uint64_t const *Heatmap() const { return nullptr; }
+};
+
+struct ProfileCounts
+{
+	std::vector<uint64_t> opcodes = std::vector<uint64_t>(0x10000);
+	std::vector<uint64_t> pcs = std::vector<uint64_t>(PROFILE_PC_SIZE);
+	uint64_t frames[PROFILE_FRAME_BUCKETS] = {};
+	uint64_t instructions = 0;
+
+	void Add(ProfileCounts const &other)
+	{
+		for (size_t i = 0; i < opcodes.size(); i++)
+		{
+			opcodes[i] += other.opcodes[i];
+		}
+		for (size_t i = 0; i < pcs.size(); i++)
+		{
+			pcs[i] += other.pcs[i];
+		}
+		for (unsigned int i = 0; i < PROFILE_FRAME_BUCKETS; i++)
+		{
+			frames[i] += other.frames[i];
+		}
+		instructions += other.instructions;
+	}
+};
+
+// Counts of every profiled machine of the process, written out at exit.
+class ProfileTotals
+{
+public:
+	static ProfileTotals &Get()
+	{
+		static ProfileTotals totals;
+		return totals;
+	}
+
+	void Add(ProfileCounts const &counts)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		totals.Add(counts);
+	}
+
+	~ProfileTotals()
+	{
+		char const *filename = std::getenv("CHIP8_PROFILE_FILE");
+		std::string name = filename ? filename : "chip8-profile.json";
+		bool csv = name.size() >= 4 && name.compare(name.size() - 4, 4, ".csv") == 0;
+
+		FILE *file = std::fopen(name.c_str(), "w");
+		if (!file)
+		{
+			return;
+		}
+
+		csv ? WriteCsv(file) : WriteJson(file);
+		std::fclose(file);
+	}
+
+private:
+	ProfileTotals() = default;
+
+	// per family (high nibble) and per handler name, summed over opcodes
+	void Group(uint64_t families[16], std::vector<std::pair<std::string, uint64_t>> &handlers) const
+	{
+		for (unsigned int op = 0; op < 0x10000; op++)
+		{
+			uint64_t count = totals.opcodes[op];
+			if (count == 0)
+			{
+				continue;
+			}
+
+			families[op >> 12u] += count;
+
+			std::string name = HandlerName(static_cast<uint16_t>(op));
+			size_t i = 0;
+			while (i < handlers.size() && handlers[i].first != name)
+			{
+				i++;
+			}
+			if (i == handlers.size())
+			{
+				handlers.push_back({name, 0});
+			}
+			handlers[i].second += count;
+		}
+	}
+
+	void WriteJson(FILE *file) const
+	{
+		uint64_t families[16] = {};
+		std::vector<std::pair<std::string, uint64_t>> handlers;
+		Group(families, handlers);
+
+		std::fprintf(file, "{\"instructions\": %llu,\n \"families\": {", static_cast<unsigned long long>(totals.instructions));
+		for (unsigned int f = 0; f < 16; f++)
+		{
+			std::fprintf(file, "%s\"%Xxxx\": %llu", f ? ", " : "", f, static_cast<unsigned long long>(families[f]));
+		}
+
+		std::fprintf(file, "},\n \"handlers\": {");
+		for (size_t i = 0; i < handlers.size(); i++)
+		{
+			std::fprintf(file, "%s\"%s\": %llu", i ? ", " : "", handlers[i].first.c_str(), static_cast<unsigned long long>(handlers[i].second));
+		}
+
+		std::fprintf(file, "},\n \"frame_us_histogram\": [");
+		for (unsigned int b = 0; b < PROFILE_FRAME_BUCKETS; b++)
+		{
+			std::fprintf(file, "%s%llu", b ? ", " : "", static_cast<unsigned long long>(totals.frames[b]));
+		}
+
+		std::fprintf(file, "],\n \"pc_heatmap\": [");
+		for (unsigned int pc = 0; pc < PROFILE_PC_SIZE; pc++)
+		{
+			std::fprintf(file, "%s%llu", pc ? (pc % 32 ? ", " : ",\n  ") : "", static_cast<unsigned long long>(totals.pcs[pc]));
+		}
+		std::fprintf(file, "]}\n");
+	}
+
+	void WriteCsv(FILE *file) const
+	{
+		uint64_t families[16] = {};
+		std::vector<std::pair<std::string, uint64_t>> handlers;
+		Group(families, handlers);
+
+		std::fprintf(file, "section,key,count\n");
+		std::fprintf(file, "total,instructions,%llu\n", static_cast<unsigned long long>(totals.instructions));
+		for (unsigned int f = 0; f < 16; f++)
+		{
+			std::fprintf(file, "family,%Xxxx,%llu\n", f, static_cast<unsigned long long>(families[f]));
+		}
+		for (auto const &handler : handlers)
+		{
+			std::fprintf(file, "handler,%s,%llu\n", handler.first.c_str(), static_cast<unsigned long long>(handler.second));
+		}
+		for (unsigned int b = 0; b < PROFILE_FRAME_BUCKETS; b++)
+		{
+			std::fprintf(file, "frame_us_below,%llu,%llu\n", 1ull << b, static_cast<unsigned long long>(totals.frames[b]));
+		}
+		for (unsigned int pc = 0; pc < PROFILE_PC_SIZE; pc++)
+		{
+			if (totals.pcs[pc])
+			{
+				std::fprintf(file, "pc,0x%03X,%llu\n", pc, static_cast<unsigned long long>(totals.pcs[pc]));
+			}
+		}
+	}
+
+	std::mutex mutex;
+	ProfileCounts totals;
+};
+
+class CountingProfile
+{
+public:
+	static constexpr bool enabled = true;
+
+	~CountingProfile()
+	{
+		// machines that never ran (e.g. scratch decoders) add nothing, which
+		// also keeps static ones from touching the totals during exit
+		if (counts.instructions > 0)
+		{
+			ProfileTotals::Get().Add(counts);
+		}
+	}
+
+	void Instruction(uint16_t pc, uint16_t opcode)
+	{
+		counts.instructions++;
+		counts.opcodes[opcode]++;
+		if (pc < PROFILE_PC_SIZE)
+		{
+			counts.pcs[pc]++;
+		}
+	}
+
+	// Called at every frame end: bucket b counts frames that took less than
+	// 2^b microseconds of host time since the previous one.
+	void Frame()
+	{
+		auto now = std::chrono::steady_clock::now();
+
+		if (started)
+		{
+			uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(now - lastFrame).count();
+			unsigned int bucket = 0;
+			while (bucket + 1 < PROFILE_FRAME_BUCKETS && us >= (1ull << bucket))
+			{
+				bucket++;
+			}
+			counts.frames[bucket]++;
+		}
+
+		lastFrame = now;
+		started = true;
+	}
+
+	// execution counts of the first PROFILE_PC_SIZE addresses
+	uint64_t const *Heatmap() const { return counts.pcs.data(); }
+
+private:
+	ProfileCounts counts;
+	std::chrono::steady_clock::time_point lastFrame;
+	bool started = false;
+};
+
+#ifdef CHIP8_PROFILE
+typedef CountingProfile ProfileSink;
+#else
+typedef NullProfile ProfileSink;
+#endif
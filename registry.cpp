@@ -0,0 +1,379 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+#include "chip8.cpp"
+#include "mapfile.cpp"
+
+// Content-addressed ROM registry.
+//
+// ROMs are identified by the SHA-1 of their bytes, the key used by the
+// community CHIP-8 databases. The registry keeps every ROM it has loaded as a
+// shared memory image plus a decode cache covering its code, so loading
+// a known ROM again costs two copies and no file reads or decoding. Paths are
+// remembered with their size and modification time; a changed file is read
+// and hashed again.
+//
+// Per-ROM settings (instructions per frame, quirks, title) come from a
+// database file and are applied by Load(). Database lines look like
+//
+//   <sha1 in hex> [ipf=<n>] [profile=<name>] [<quirk> ...] [# title]
+//
+// where a profile is one of QUIRK_PROFILES and the quirks, added on top of
+// it, are shift-vy, load-store-i, load-store-x, jump-vx and clip.
+//
+// Blank lines and lines starting with # are ignored. The database is read
+// from $CHIP8_ROM_DB, or romdb.txt in the working directory.
+
+typedef std::array<uint8_t, 20> Sha1Digest;
+
+inline char const *RomDatabasePath()
+{
+	char const *path = std::getenv("CHIP8_ROM_DB");
+	return path ? path : "romdb.txt";
+}
+
+Sha1Digest Sha1(void const *data, size_t size)
+{
+	uint32_t h[5] = {0x67452301u, 0xEFCDAB89u, 0x98BADCFEu, 0x10325476u, 0xC3D2E1F0u};
+	uint8_t const *bytes = static_cast<uint8_t const *>(data);
+
+	auto rotl = [](uint32_t x, int n)
+	{ return (x << n) | (x >> (32 - n)); };
+
+	// the message, a 0x80 byte, zeros and the bit length fill whole blocks
+	size_t blocks = (size + 8) / 64 + 1;
+	uint8_t block[64];
+
+	for (size_t n = 0; n < blocks; n++)
+	{
+		for (size_t i = 0; i < 64; i++)
+		{
+			size_t at = n * 64 + i;
+			block[i] = at < size ? bytes[at] : at == size ? 0x80 : 0;
+		}
+		if (n == blocks - 1)
+		{
+			uint64_t bits = static_cast<uint64_t>(size) * 8;
+			for (int i = 0; i < 8; i++)
+			{
+				block[63 - i] = static_cast<uint8_t>(bits >> (8 * i));
+			}
+		}
+
+		uint32_t w[80];
+		for (int i = 0; i < 16; i++)
+		{
+			w[i] = block[4 * i] << 24u | block[4 * i + 1] << 16u | block[4 * i + 2] << 8u | block[4 * i + 3];
+		}
+		for (int i = 16; i < 80; i++)
+		{
+			w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++)
+		{
+			uint32_t f, k;
+			if (i < 20)
+			{
+				f = (b & c) | (~b & d), k = 0x5A827999u;
+			}
+			else if (i < 40)
+			{
+				f = b ^ c ^ d, k = 0x6ED9EBA1u;
+			}
+			else if (i < 60)
+			{
+				f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDCu;
+			}
+			else
+			{
+				f = b ^ c ^ d, k = 0xCA62C1D6u;
+			}
+
+			uint32_t t = rotl(a, 5) + f + e + k + w[i];
+			e = d, d = c, c = rotl(b, 30), b = a, a = t;
+		}
+
+		h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+	}
+
+	Sha1Digest digest;
+	for (int i = 0; i < 20; i++)
+	{
+		digest[i] = static_cast<uint8_t>(h[i / 4] >> (24 - 8 * (i % 4)));
+	}
+	return digest;
+}
+
+std::string ToHex(Sha1Digest const &digest)
+{
+	static char const DIGITS[] = "0123456789abcdef";
+	std::string hex;
+
+	for (uint8_t byte : digest)
+	{
+		hex += DIGITS[byte >> 4u];
+		hex += DIGITS[byte & 0xFu];
+	}
+	return hex;
+}
+
+struct RomConfig
+{
+	std::string title;
+	uint32_t cyclesPerFrame = 0; // 0 leaves the machine's setting alone
+	unsigned quirks = PROFILE_LEGACY;
+};
+
+struct RomEntry
+{
+	Sha1Digest sha1;
+	size_t size;
+	std::shared_ptr<MemoryImage const> image;
+	std::vector<DecodedOp> decoded; // CODE_SIZE entries
+};
+
+class RomRegistry
+{
+public:
+	// Add the entries of a database file. Returns false if it cannot be
+	// read; lines that do not parse are skipped.
+	bool LoadDatabase(char const *filename)
+	{
+		MappedFile file;
+		if (!file.Open(filename))
+		{
+			return false;
+		}
+
+		char const *text = reinterpret_cast<char const *>(file.Data());
+		char const *end = text + file.Size();
+
+		while (text < end)
+		{
+			char const *newline = static_cast<char const *>(memchr(text, '\n', end - text));
+			char const *lineEnd = newline ? newline : end;
+			ParseLine(std::string(text, lineEnd));
+			text = lineEnd + 1;
+		}
+		return true;
+	}
+
+	void Configure(Sha1Digest const &sha1, RomConfig const &config)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		configs[ToHex(sha1)] = config;
+	}
+
+	// Settings for a ROM, or null if the database has none.
+	RomConfig const *Config(Sha1Digest const &sha1) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = configs.find(ToHex(sha1));
+		return found == configs.end() ? nullptr : &found->second;
+	}
+
+	// The cached entry for a ROM file, reading it if it is new or changed.
+	std::shared_ptr<RomEntry const> Find(char const *filename, RomError &error)
+	{
+		struct stat info;
+		if (stat(filename, &info) != 0)
+		{
+			error = RomError::Open;
+			return nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		auto known = paths.find(filename);
+		if (known != paths.end() && known->second.size == static_cast<uint64_t>(info.st_size) && known->second.modified == static_cast<int64_t>(info.st_mtime))
+		{
+			hits++;
+			error = RomError::None;
+			return known->second.entry;
+		}
+
+		MappedFile file;
+		error = file.Open(filename) ? CheckRomSize(file.Size()) : RomError::Open;
+		if (error != RomError::None)
+		{
+			return nullptr;
+		}
+
+		misses++;
+		Sha1Digest sha1 = Sha1(file.Data(), file.Size());
+
+		// the same bytes under another path share one entry
+		std::shared_ptr<RomEntry const> &entry = contents[ToHex(sha1)];
+		if (!entry)
+		{
+			entry = NewEntry(sha1, file.Data(), file.Size());
+		}
+
+		paths[filename] = {static_cast<uint64_t>(info.st_size), static_cast<int64_t>(info.st_mtime), entry};
+		return entry;
+	}
+
+	// LoadROM through the registry: load the cached image and decode cache
+	// into chip8 and apply the ROM's database settings, if any. Those are
+	// returned through applied, which is set to null for an unknown ROM.
+	RomError Load(Chip8 &chip8, char const *filename, RomConfig const **applied = nullptr)
+	{
+		RomError error;
+		std::shared_ptr<RomEntry const> entry = Find(filename, error);
+		RomConfig const *config = entry ? Config(entry->sha1) : nullptr;
+
+		if (entry)
+		{
+			chip8.LoadImage(entry->image, entry->decoded.data());
+		}
+
+		if (config)
+		{
+			chip8.quirks = config->quirks;
+			if (config->cyclesPerFrame > 0)
+			{
+				chip8.cyclesPerFrame = config->cyclesPerFrame;
+			}
+		}
+
+		if (applied)
+		{
+			*applied = config;
+		}
+		return error;
+	}
+
+	uint64_t Hits() const { return hits; }
+	uint64_t Misses() const { return misses; }
+
+private:
+	struct PathEntry
+	{
+		uint64_t size;
+		int64_t modified;
+		std::shared_ptr<RomEntry const> entry;
+	};
+
+	static std::shared_ptr<RomEntry const> NewEntry(Sha1Digest const &sha1, uint8_t const *rom, size_t size)
+	{
+		auto entry = std::make_shared<RomEntry>();
+		entry->sha1 = sha1;
+		entry->size = size;
+		entry->image = BuildRomImage(rom, size);
+
+		// decoding depends only on the bytes, so decode every address once
+		auto scratch = std::make_unique<Chip8>(0);
+		scratch->LoadImage(entry->image);
+		for (uint16_t address = 0; address < CODE_SIZE; address++)
+		{
+			scratch->Decode(address);
+		}
+		entry->decoded.assign(scratch->decoded, scratch->decoded + CODE_SIZE);
+
+		return entry;
+	}
+
+	static unsigned QuirkNamed(std::string const &word)
+	{
+		static struct
+		{
+			char const *name;
+			unsigned bit;
+		} const NAMES[] = {
+			{"shift-vy", QUIRK_SHIFT_VY},
+			{"load-store-i", QUIRK_LOAD_STORE_I},
+			{"load-store-x", QUIRK_LOAD_STORE_X},
+			{"jump-vx", QUIRK_JUMP_VX},
+			{"clip", QUIRK_CLIP}};
+
+		for (auto const &name : NAMES)
+		{
+			if (word == name.name)
+			{
+				return name.bit;
+			}
+		}
+		return 0;
+	}
+
+	void ParseLine(std::string line)
+	{
+		std::string title;
+		size_t hash = line.find('#');
+		if (hash != std::string::npos)
+		{
+			size_t start = line.find_first_not_of(" \t", hash + 1);
+			size_t end = line.find_last_not_of(" \t\r");
+			title = start != std::string::npos && end >= start ? line.substr(start, end - start + 1) : "";
+			line.resize(hash);
+		}
+
+		std::vector<std::string> words;
+		size_t at = 0;
+		while ((at = line.find_first_not_of(" \t\r", at)) != std::string::npos)
+		{
+			size_t end = line.find_first_of(" \t\r", at);
+			words.push_back(line.substr(at, end - at));
+			at = end;
+		}
+
+		if (words.empty() || words[0].size() != 40 || words[0].find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+		{
+			return;
+		}
+
+		RomConfig config;
+		config.title = title;
+
+		for (size_t i = 1; i < words.size(); i++)
+		{
+			std::string const &word = words[i];
+
+			unsigned profile;
+
+			if (word.compare(0, 4, "ipf=") == 0)
+			{
+				config.cyclesPerFrame = static_cast<uint32_t>(std::strtoul(word.c_str() + 4, nullptr, 10));
+			}
+			else if (word.compare(0, 8, "profile=") == 0 && FindQuirkProfile(word.c_str() + 8, profile))
+			{
+				config.quirks |= profile;
+			}
+			else if (unsigned bit = QuirkNamed(word))
+			{
+				config.quirks |= bit;
+			}
+			else
+			{
+				return;
+			}
+		}
+
+		std::string key = words[0];
+		for (char &c : key)
+		{
+			c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		configs[key] = config;
+	}
+
+	mutable std::mutex mutex;
+	std::unordered_map<std::string, RomConfig> configs;			  // by hex SHA-1
+	std::unordered_map<std::string, std::shared_ptr<RomEntry const>> contents; // by hex SHA-1
+	std::unordered_map<std::string, PathEntry> paths;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+};
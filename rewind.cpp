@@ -0,0 +1,283 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include "chip8.cpp"
+#include "savestate.cpp"
+
+// Rewind history of per-frame states.
+//
+// Each pushed frame is flattened into a fixed-size raw image (MachineState,
+// zero-padded to its high resolution size, followed by memory). Every KEYFRAME_INTERVAL frames the raw image is kept
+// as a keyframe; the frames in between store the XOR of their raw image
+// against that keyframe. Both are run-length encoded: the XOR deltas are
+// almost all zero, so a frame usually costs well under a kilobyte.
+//
+// Seeking to a frame decodes one keyframe and at most one delta. Once the
+// memory held (allocated vector capacity, including the raw working
+// buffers) exceeds the byte budget the oldest keyframe group is dropped, so
+// only the newest frames are kept. A group's vectors are shrunk to fit when
+// the next one starts.
+//
+// RLE stream: repeated (varint zero run, varint literal length, literals),
+// with the varints of StateWriter/StateReader.
+
+class Rewind
+{
+public:
+	static constexpr size_t KEYFRAME_INTERVAL = 120;
+	static constexpr size_t DEFAULT_BUDGET = 16u << 20;
+
+	explicit Rewind(size_t budget = DEFAULT_BUDGET)
+		: budget(budget)
+	{
+		// the largest state: a high resolution screen
+		std::vector<uint8_t> probe;
+		StateWriter w(probe);
+		MachineState largest;
+		largest.hires = 1;
+		largest.Write(w);
+
+		stateSize = probe.size();
+		raw.resize(stateSize + MEMORY_SIZE);
+		keyRaw.resize(raw.size());
+		scratch.resize(raw.size());
+		buffers = raw.capacity() + keyRaw.capacity() + scratch.capacity();
+	}
+
+	// Record chip8's current state as the newest frame.
+	void Push(Chip8 const &chip8)
+	{
+		Flatten(chip8, raw.data());
+
+		if (groups.empty() || groups.back().Frames() == KEYFRAME_INTERVAL)
+		{
+			if (!groups.empty())
+			{
+				Group &closed = groups.back();
+				bytes -= closed.Size();
+				closed.deltas.shrink_to_fit();
+				closed.ends.shrink_to_fit();
+				bytes += closed.Size();
+			}
+
+			groups.emplace_back();
+			Group &group = groups.back();
+			Encode(raw.data(), nullptr, raw.size(), group.keyframe);
+			group.keyframe.shrink_to_fit();
+			memcpy(keyRaw.data(), raw.data(), raw.size());
+			bytes += group.Size();
+		}
+		else
+		{
+			Group &group = groups.back();
+			size_t before = group.Size();
+
+			Encode(raw.data(), keyRaw.data(), raw.size(), group.deltas);
+			group.ends.push_back(static_cast<uint32_t>(group.deltas.size()));
+			bytes += group.Size() - before;
+		}
+
+		while (Bytes() > budget && groups.size() > 1)
+		{
+			bytes -= groups.front().Size();
+			first += groups.front().Frames();
+			groups.pop_front();
+		}
+	}
+
+	// Restore chip8 to an absolute frame number in [First(), End()).
+	bool Seek(Chip8 &chip8, uint64_t frame)
+	{
+		if (frame < first || frame >= End())
+		{
+			return false;
+		}
+
+		size_t offset = frame - first;
+		Group const &group = groups[offset / KEYFRAME_INTERVAL];
+		size_t delta = offset % KEYFRAME_INTERVAL;
+
+		memset(scratch.data(), 0, scratch.size());
+		Decode(group.keyframe.data(), group.keyframe.size(), scratch.data());
+
+		if (delta > 0)
+		{
+			size_t start = delta > 1 ? group.ends[delta - 2] : 0;
+			Decode(group.deltas.data() + start, group.ends[delta - 1] - start, scratch.data());
+		}
+
+		Restore(chip8, scratch.data());
+		return true;
+	}
+
+	// Drop the newest frame and restore the one before it. The oldest frame
+	// is never dropped, holding the key there keeps restoring it.
+	bool StepBack(Chip8 &chip8)
+	{
+		if (groups.empty())
+		{
+			return false;
+		}
+
+		if (End() - first > 1)
+		{
+			Truncate(End() - 1);
+		}
+
+		return Seek(chip8, End() - 1);
+	}
+
+	// Forget every frame from `frame` on.
+	void Truncate(uint64_t frame)
+	{
+		while (!groups.empty() && End() > frame)
+		{
+			Group &group = groups.back();
+
+			if (End() - group.Frames() >= frame)
+			{
+				bytes -= group.Size();
+				groups.pop_back();
+				continue;
+			}
+
+			size_t keep = frame - (End() - group.Frames()) - 1;
+			size_t size = keep ? group.ends[keep - 1] : 0;
+
+			// capacity stays allocated for the frames pushed next
+			group.deltas.resize(size);
+			group.ends.resize(keep);
+		}
+
+		if (groups.empty())
+		{
+			first = frame;
+		}
+		else
+		{
+			memset(keyRaw.data(), 0, keyRaw.size());
+			Decode(groups.back().keyframe.data(), groups.back().keyframe.size(), keyRaw.data());
+		}
+	}
+
+	uint64_t First() const { return first; }
+	uint64_t End() const
+	{
+		return groups.empty() ? first : first + (groups.size() - 1) * KEYFRAME_INTERVAL + groups.back().Frames();
+	}
+	// memory held by the history and its working buffers
+	size_t Bytes() const { return bytes + buffers; }
+
+private:
+	struct Group
+	{
+		std::vector<uint8_t> keyframe;
+		std::vector<uint8_t> deltas;
+		std::vector<uint32_t> ends; // end offset of each delta in deltas
+
+		size_t Frames() const { return 1 + ends.size(); }
+		size_t Size() const { return keyframe.capacity() + deltas.capacity() + ends.capacity() * sizeof(uint32_t); }
+	};
+
+	void Flatten(Chip8 const &chip8, uint8_t *out)
+	{
+		std::vector<uint8_t> &state = stateBuffer;
+		state.clear();
+		StateWriter w(state);
+
+		MachineState machine;
+		machine.Capture(chip8);
+		machine.Write(w);
+
+		memcpy(out, state.data(), state.size());
+		memset(out + state.size(), 0, stateSize - state.size());
+		memcpy(out + stateSize, chip8.memory, MEMORY_SIZE);
+	}
+
+	void Restore(Chip8 &chip8, uint8_t const *in)
+	{
+		StateReader r(in, stateSize);
+		MachineState machine;
+		machine.Read(r);
+		machine.Apply(chip8);
+
+		uint8_t const *pages[STATE_PAGES];
+		for (unsigned int page = 0; page < STATE_PAGES; page++)
+		{
+			pages[page] = in + stateSize + page * STATE_PAGE_SIZE;
+		}
+		RestoreMemory(chip8, pages);
+	}
+
+	// Append the RLE of data ^ base (base may be null for zeros) to out.
+	static void Encode(uint8_t const *data, uint8_t const *base, size_t size, std::vector<uint8_t> &out)
+	{
+		auto at = [data, base](size_t i)
+		{ return static_cast<uint8_t>(base ? data[i] ^ base[i] : data[i]); };
+
+		StateWriter w(out);
+		size_t i = 0;
+		while (i < size)
+		{
+			size_t zeros = i;
+			while (zeros < size && at(zeros) == 0)
+			{
+				zeros++;
+			}
+
+			// a literal run ends at the first pair of zero bytes
+			size_t end = zeros;
+			while (end < size && (at(end) != 0 || (end + 1 < size && at(end + 1) != 0)))
+			{
+				end++;
+			}
+
+			if (zeros == size)
+			{
+				break;
+			}
+
+			w.Varint(zeros - i);
+			w.Varint(end - zeros);
+			for (size_t j = zeros; j < end; j++)
+			{
+				w.U8(at(j));
+			}
+
+			i = end;
+		}
+	}
+
+	// XOR a stream produced by Encode into out.
+	static void Decode(uint8_t const *in, size_t size, uint8_t *out)
+	{
+		StateReader r(in, size);
+		size_t position = 0;
+		uint64_t zeros, literals;
+
+		while (r.Varint(zeros) && r.Varint(literals))
+		{
+			position += zeros;
+
+			for (uint64_t j = 0; j < literals; j++)
+			{
+				uint8_t byte = 0;
+				r.U8(byte);
+				out[position++] ^= byte;
+			}
+		}
+	}
+
+	std::deque<Group> groups;
+	uint64_t first = 0;
+	size_t bytes = 0;   // Size() of every group
+	size_t buffers = 0; // raw, keyRaw and scratch
+	size_t budget;
+	size_t stateSize;
+	std::vector<uint8_t> raw;
+	std::vector<uint8_t> keyRaw;
+	std::vector<uint8_t> scratch;
+	std::vector<uint8_t> stateBuffer;
+};
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "chip8.cpp"
+#include "savestate.cpp"
+
+// Run-ahead: hide the frame or two many games take between reading the
+// keypad and showing the result.
+//
+// After every real frame, Preview() saves the machine, runs it `frames`
+// further frames with the keys held now, hands that future machine to the
+// caller to copy its screen out, and restores the saved state, so the real
+// timeline (RNG, cycles, memory) is untouched. The extra frames are never
+// presented on their own. With the save state's page diffing a save and a
+// restore take a few microseconds, so the extra frames are most of the cost.
+//
+// Profiles and traces also count the instructions run ahead.
+
+class RunAhead
+{
+public:
+	explicit RunAhead(unsigned int frames) : frames(frames) {}
+
+	unsigned int Frames() const { return frames; }
+
+	// show(future) is called with chip8 as it will be after `frames` more
+	// frames; screenDirty tells whether it drew on the way.
+	template <typename Show>
+	void Preview(Chip8 &chip8, Show &&show)
+	{
+		bool dirty = chip8.screenDirty;
+		uint64_t idle = chip8.idleCycles;
+
+		SaveState(chip8, saved);
+
+		chip8.screenDirty = false;
+		for (unsigned int i = 0; i < frames; i++)
+		{
+			chip8.RunCycles(chip8.cyclesPerFrame);
+		}
+		show(static_cast<Chip8 const &>(chip8));
+
+		LoadState(chip8, saved);
+		chip8.screenDirty = dirty;
+		chip8.idleCycles = idle;
+	}
+
+private:
+	unsigned int frames;
+	std::vector<uint8_t> saved;
+};
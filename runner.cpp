@@ -0,0 +1,239 @@
+#pragma once
+#include <cstdint>
+#include <new>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "chip8.cpp"
+#include "savestate.cpp"
+
+// Parallel runner for many independent machines (fuzzing, replays, CI).
+//
+// The machines live in one arena of cache-line aligned slots so that workers
+// on neighbouring instances never share a line. Run() splits the work into
+// tasks of framesPerTask frames of one instance. Each worker owns a deque of
+// instance indices: it pops from the back, runs one task and pushes the
+// instance back while it has frames left, so an instance stays on one core
+// while that core is busy. A worker that runs dry steals from the front of a
+// random victim's deque.
+
+struct alignas(64) FleetSlot
+{
+	explicit FleetSlot(uint64_t seed) : chip8(seed) {}
+
+	Chip8 chip8;
+	uint64_t framesLeft = 0;
+	uint64_t stateHash = 0; // StateHash() of the machine once its frames are done
+};
+
+struct FleetStats
+{
+	uint64_t cycles = 0;
+	double seconds = 0;
+	uint64_t tasks = 0;
+	uint64_t steals = 0;
+	unsigned int threads = 0;
+};
+
+class Fleet
+{
+public:
+	static constexpr uint32_t DEFAULT_FRAMES_PER_TASK = 60;
+
+	// Called before every frame of an instance, e.g. to feed it input.
+	typedef std::function<void(Chip8 &chip8, size_t instance, uint64_t frame)> FrameHook;
+
+	// Construct count machines, seeding machine i with seed + i.
+	Fleet(size_t count, uint64_t seed)
+		: count(count),
+		  slots(static_cast<FleetSlot *>(::operator new(count * sizeof(FleetSlot), std::align_val_t(alignof(FleetSlot)))))
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			new (&slots[i]) FleetSlot(seed + i);
+		}
+	}
+
+	~Fleet()
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			slots[i].~FleetSlot();
+		}
+		::operator delete(slots, std::align_val_t(alignof(FleetSlot)));
+	}
+
+	Fleet(Fleet const &) = delete;
+	Fleet &operator=(Fleet const &) = delete;
+
+	size_t Size() const { return count; }
+	FleetSlot &operator[](size_t i) { return slots[i]; }
+	FleetSlot const &operator[](size_t i) const { return slots[i]; }
+
+	// Run every instance for `frames` frames on `threads` workers (all cores
+	// by default) and return the aggregate throughput.
+	FleetStats Run(uint64_t frames, unsigned int threads = 0, uint32_t framesPerTask = DEFAULT_FRAMES_PER_TASK, FrameHook hook = nullptr)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			slots[i].framesLeft = frames;
+		}
+		return RunFramesLeft(threads, framesPerTask, hook);
+	}
+
+	// Run every instance for the whole frames closest to `cycles`
+	// instructions at its own cyclesPerFrame (at least one frame).
+	FleetStats RunCycles(uint64_t cycles, unsigned int threads = 0, uint32_t framesPerTask = DEFAULT_FRAMES_PER_TASK, FrameHook hook = nullptr)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			slots[i].framesLeft = std::max<uint64_t>(1, cycles / slots[i].chip8.cyclesPerFrame);
+		}
+		return RunFramesLeft(threads, framesPerTask, hook);
+	}
+
+private:
+	struct alignas(64) Worker
+	{
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+		uint64_t tasksRun = 0;
+		uint64_t steals = 0;
+	};
+
+	FleetStats RunFramesLeft(unsigned int threads, uint32_t framesPerTask, FrameHook const &hook)
+	{
+		if (threads == 0)
+		{
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		std::vector<Worker> workers(threads);
+		for (size_t i = 0; i < count; i++)
+		{
+			workers[i % threads].tasks.push_back(i);
+		}
+
+		uint64_t startCycles = TotalCycles();
+		remaining.store(count);
+
+		auto start = std::chrono::steady_clock::now();
+
+		std::vector<std::thread> pool;
+		for (unsigned int t = 1; t < threads; t++)
+		{
+			pool.emplace_back(&Fleet::Work, this, std::ref(workers), t, framesPerTask, std::cref(hook));
+		}
+		Work(workers, 0, framesPerTask, hook);
+
+		for (std::thread &thread : pool)
+		{
+			thread.join();
+		}
+
+		FleetStats stats;
+		stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		stats.cycles = TotalCycles() - startCycles;
+		stats.threads = threads;
+
+		for (Worker const &worker : workers)
+		{
+			stats.tasks += worker.tasksRun;
+			stats.steals += worker.steals;
+		}
+
+		return stats;
+	}
+
+	void Work(std::vector<Worker> &workers, unsigned int self, uint32_t framesPerTask, FrameHook const &hook)
+	{
+		Worker &own = workers[self];
+		std::minstd_rand random(self + 1);
+
+		while (remaining.load(std::memory_order_acquire) > 0)
+		{
+			size_t instance;
+			bool found = false;
+
+			{
+				std::lock_guard<std::mutex> lock(own.mutex);
+				if (!own.tasks.empty())
+				{
+					instance = own.tasks.back();
+					own.tasks.pop_back();
+					found = true;
+				}
+			}
+
+			for (size_t attempt = 0; !found && attempt < workers.size(); attempt++)
+			{
+				Worker &victim = workers[random() % workers.size()];
+				if (&victim == &own)
+				{
+					continue;
+				}
+
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (!victim.tasks.empty())
+				{
+					instance = victim.tasks.front();
+					victim.tasks.pop_front();
+					found = true;
+					own.steals++;
+				}
+			}
+
+			if (!found)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			FleetSlot &slot = slots[instance];
+			uint64_t run = std::min<uint64_t>(framesPerTask, slot.framesLeft);
+
+			for (uint64_t i = 0; i < run; i++)
+			{
+				if (hook)
+				{
+					hook(slot.chip8, instance, slot.chip8.cycles / slot.chip8.cyclesPerFrame);
+				}
+				slot.chip8.RunFrame();
+			}
+
+			slot.framesLeft -= run;
+			own.tasksRun++;
+
+			if (slot.framesLeft > 0)
+			{
+				std::lock_guard<std::mutex> lock(own.mutex);
+				own.tasks.push_back(instance);
+			}
+			else
+			{
+				slot.stateHash = StateHash(slot.chip8);
+				remaining.fetch_sub(1, std::memory_order_release);
+			}
+		}
+	}
+
+	uint64_t TotalCycles() const
+	{
+		uint64_t total = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			total += slots[i].chip8.cycles;
+		}
+		return total;
+	}
+
+	size_t count;
+	FleetSlot *slots;
+	std::atomic<size_t> remaining{0};
+};
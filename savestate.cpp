@@ -0,0 +1,386 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "chip8.cpp"
+
+// Versioned save states.
+//
+// Layout (little endian):
+//   "C8ST", uint16 version, uint64 hash of the loaded memory image
+//   registers[16], pc, index, stack[16], sp, delayTimer, soundTimer,
+//   keypad[16], opcode, cycles, frameCycle, cyclesPerFrame, quirks, RNG state,
+//   hires, planes, flags[16], audioPattern[16], pitch,
+//   the words of each screen plane used at the current resolution
+//   STATE_PAGES-bit bitmap of memory pages that differ from the loaded image,
+//   followed by those pages
+//
+// A state can only be restored into a machine that loaded the same ROM, since
+// unchanged pages are taken from that machine's loadedImage. Restoring
+// rewrites and invalidates only the pages whose contents actually change, so
+// it stays close to a plain memcpy of the registers.
+
+const uint16_t STATE_VERSION = 3;
+const unsigned int STATE_PAGE_SIZE = 256;
+const unsigned int STATE_PAGES = MEMORY_SIZE / STATE_PAGE_SIZE;
+
+class StateWriter
+{
+public:
+	explicit StateWriter(std::vector<uint8_t> &out) : out(out) {}
+
+	void Bytes(void const *data, size_t size)
+	{
+		uint8_t const *bytes = static_cast<uint8_t const *>(data);
+		out.insert(out.end(), bytes, bytes + size);
+	}
+
+	void U8(uint8_t value) { out.push_back(value); }
+	void U16(uint16_t value) { Uint(value, 2); }
+	void U32(uint32_t value) { Uint(value, 4); }
+	void U64(uint64_t value) { Uint(value, 8); }
+
+	void Varint(uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back(static_cast<uint8_t>(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back(static_cast<uint8_t>(value));
+	}
+
+private:
+	void Uint(uint64_t value, int size)
+	{
+		for (int i = 0; i < size; i++)
+		{
+			out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+		}
+	}
+
+	std::vector<uint8_t> &out;
+};
+
+class StateReader
+{
+public:
+	StateReader(uint8_t const *data, size_t size) : data(data), size(size) {}
+
+	bool Bytes(void *dest, size_t count)
+	{
+		if (offset + count > size)
+		{
+			return false;
+		}
+
+		memcpy(dest, data + offset, count);
+		offset += count;
+		return true;
+	}
+
+	uint8_t const *Skip(size_t count)
+	{
+		if (offset + count > size)
+		{
+			return nullptr;
+		}
+
+		offset += count;
+		return data + offset - count;
+	}
+
+	bool U8(uint8_t &value) { return Bytes(&value, 1); }
+
+	template <typename T>
+	bool Uint(T &value)
+	{
+		uint8_t const *bytes = Skip(sizeof(T));
+		if (!bytes)
+		{
+			return false;
+		}
+
+		uint64_t result = 0;
+		for (size_t i = 0; i < sizeof(T); i++)
+		{
+			result |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+		}
+		value = static_cast<T>(result);
+		return true;
+	}
+
+	bool Varint(uint64_t &value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			uint8_t byte;
+			if (!U8(byte))
+			{
+				return false;
+			}
+
+			value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool AtEnd() const { return offset == size; }
+
+private:
+	uint8_t const *data;
+	size_t size;
+	size_t offset = 0;
+};
+
+// Everything but memory: the fixed-size part of a state.
+struct MachineState
+{
+	uint8_t registers[16] = {};
+	uint16_t pc = 0;
+	uint16_t index = 0;
+	uint16_t stack[16] = {};
+	uint8_t sp = 0;
+	uint8_t delayTimer = 0;
+	uint8_t soundTimer = 0;
+	uint8_t keypad[16] = {};
+	uint16_t opcode = 0;
+	uint64_t cycles = 0;
+	uint32_t frameCycle = 0;
+	uint32_t cyclesPerFrame = 0;
+	uint32_t quirks = 0;
+	uint32_t rng = 0;
+	uint8_t hires = 0;
+	uint8_t planes = 0;
+	uint8_t flags[16] = {};
+	uint8_t audioPattern[16] = {};
+	uint8_t pitch = 0;
+	uint64_t screen[PLANES][PLANE_WORDS] = {};
+
+	// the packed rows of a plane at this state's resolution
+	unsigned int PlaneWords() const { return hires ? PLANE_WORDS : SCREEN_HEIGHT; }
+
+	void Capture(Chip8 const &chip8)
+	{
+		memcpy(registers, chip8.registers, sizeof(registers));
+		pc = chip8.pc;
+		index = chip8.index;
+		memcpy(stack, chip8.stack, sizeof(stack));
+		sp = chip8.sp;
+		delayTimer = chip8.delayTimer;
+		soundTimer = chip8.soundTimer;
+		memcpy(keypad, chip8.keypad, sizeof(keypad));
+		opcode = chip8.opcode;
+		cycles = chip8.cycles;
+		frameCycle = chip8.frameCycle;
+		cyclesPerFrame = chip8.cyclesPerFrame;
+		quirks = chip8.quirks;
+		rng = chip8.randGen.state;
+		hires = chip8.hires;
+		planes = chip8.planes;
+		memcpy(flags, chip8.flags, sizeof(flags));
+		memcpy(audioPattern, chip8.audioPattern, sizeof(audioPattern));
+		pitch = chip8.pitch;
+		memcpy(screen, chip8.screen, sizeof(screen));
+	}
+
+	void Apply(Chip8 &chip8) const
+	{
+		memcpy(chip8.registers, registers, sizeof(registers));
+		chip8.pc = pc;
+		chip8.index = index;
+		memcpy(chip8.stack, stack, sizeof(stack));
+		chip8.sp = sp;
+		chip8.delayTimer = delayTimer;
+		chip8.soundTimer = soundTimer;
+		memcpy(chip8.keypad, keypad, sizeof(keypad));
+		chip8.opcode = opcode;
+		chip8.cycles = cycles;
+		chip8.frameCycle = frameCycle;
+		chip8.cyclesPerFrame = cyclesPerFrame;
+		chip8.quirks = quirks;
+		chip8.randGen.state = rng;
+		chip8.hires = hires != 0;
+		chip8.planes = planes;
+		memcpy(chip8.flags, flags, sizeof(flags));
+		memcpy(chip8.audioPattern, audioPattern, sizeof(audioPattern));
+		chip8.pitch = pitch;
+		memcpy(chip8.screen, screen, sizeof(screen));
+		chip8.screenDirty = true;
+	}
+
+	void Write(StateWriter &w) const
+	{
+		w.Bytes(registers, sizeof(registers));
+		w.U16(pc);
+		w.U16(index);
+		for (uint16_t entry : stack)
+		{
+			w.U16(entry);
+		}
+		w.U8(sp);
+		w.U8(delayTimer);
+		w.U8(soundTimer);
+		w.Bytes(keypad, sizeof(keypad));
+		w.U16(opcode);
+		w.U64(cycles);
+		w.U32(frameCycle);
+		w.U32(cyclesPerFrame);
+		w.U32(quirks);
+		w.U32(rng);
+		w.U8(hires);
+		w.U8(planes);
+		w.Bytes(flags, sizeof(flags));
+		w.Bytes(audioPattern, sizeof(audioPattern));
+		w.U8(pitch);
+		for (auto const &plane : screen)
+		{
+			for (unsigned int i = 0; i < PlaneWords(); i++)
+			{
+				w.U64(plane[i]);
+			}
+		}
+	}
+
+	bool Read(StateReader &r)
+	{
+		bool ok = r.Bytes(registers, sizeof(registers)) && r.Uint(pc) && r.Uint(index);
+		for (uint16_t &entry : stack)
+		{
+			ok = ok && r.Uint(entry);
+		}
+		ok = ok && r.U8(sp) && r.U8(delayTimer) && r.U8(soundTimer) &&
+			 r.Bytes(keypad, sizeof(keypad)) && r.Uint(opcode) && r.Uint(cycles) &&
+			 r.Uint(frameCycle) && r.Uint(cyclesPerFrame) && r.Uint(quirks) && r.Uint(rng) &&
+			 r.U8(hires) && r.U8(planes) && r.Bytes(flags, sizeof(flags)) &&
+			 r.Bytes(audioPattern, sizeof(audioPattern)) && r.U8(pitch);
+		for (auto &plane : screen)
+		{
+			for (unsigned int i = 0; i < PlaneWords(); i++)
+			{
+				ok = ok && r.Uint(plane[i]);
+			}
+		}
+		return ok;
+	}
+};
+
+// Copy source into chip8's memory page by page, rewriting and invalidating
+// only the pages whose contents differ.
+void RestoreMemory(Chip8 &chip8, uint8_t const *const *pages)
+{
+	for (unsigned int page = 0; page < STATE_PAGES; page++)
+	{
+		uint8_t *current = chip8.memory + page * STATE_PAGE_SIZE;
+
+		if (memcmp(current, pages[page], STATE_PAGE_SIZE) != 0)
+		{
+			memcpy(current, pages[page], STATE_PAGE_SIZE);
+			chip8.InvalidateDecoded(page * STATE_PAGE_SIZE, STATE_PAGE_SIZE);
+		}
+	}
+}
+
+// Serialize chip8 into out (replacing its contents).
+void SaveState(Chip8 const &chip8, std::vector<uint8_t> &out)
+{
+	out.clear();
+	StateWriter w(out);
+
+	w.Bytes("C8ST", 4);
+	w.U16(STATE_VERSION);
+	w.U64(chip8.loadedHash);
+
+	MachineState state;
+	state.Capture(chip8);
+	state.Write(w);
+
+	uint8_t changed[STATE_PAGES / 8] = {};
+	for (unsigned int page = 0; page < STATE_PAGES; page++)
+	{
+		uint8_t const *current = chip8.memory + page * STATE_PAGE_SIZE;
+
+		if (!chip8.loadedImage || memcmp(current, chip8.loadedImage->data() + page * STATE_PAGE_SIZE, STATE_PAGE_SIZE) != 0)
+		{
+			changed[page / 8] |= 1u << (page % 8);
+		}
+	}
+
+	w.Bytes(changed, sizeof(changed));
+	for (unsigned int page = 0; page < STATE_PAGES; page++)
+	{
+		if (changed[page / 8] & (1u << (page % 8)))
+		{
+			w.Bytes(chip8.memory + page * STATE_PAGE_SIZE, STATE_PAGE_SIZE);
+		}
+	}
+}
+
+// Restore a state produced by SaveState. Returns false, leaving chip8
+// untouched, if the data is malformed, from another version, or was taken
+// against a different ROM.
+bool LoadState(Chip8 &chip8, uint8_t const *data, size_t size)
+{
+	StateReader r(data, size);
+
+	char magic[4];
+	uint16_t version;
+	uint64_t hash;
+
+	if (!r.Bytes(magic, 4) || memcmp(magic, "C8ST", 4) != 0 ||
+		!r.Uint(version) || version != STATE_VERSION ||
+		!r.Uint(hash) || hash != chip8.loadedHash)
+	{
+		return false;
+	}
+
+	// parse into a scratch copy so failures leave chip8 as is
+	MachineState state;
+	uint8_t changed[STATE_PAGES / 8];
+	bool ok = state.Read(r) && r.Bytes(changed, sizeof(changed));
+
+	uint8_t const *pages[STATE_PAGES] = {};
+	for (unsigned int page = 0; ok && page < STATE_PAGES; page++)
+	{
+		if (changed[page / 8] & (1u << (page % 8)))
+		{
+			pages[page] = r.Skip(STATE_PAGE_SIZE);
+			ok = pages[page] != nullptr;
+		}
+		else if (!chip8.loadedImage)
+		{
+			ok = false;
+		}
+		else
+		{
+			pages[page] = chip8.loadedImage->data() + page * STATE_PAGE_SIZE;
+		}
+	}
+
+	if (!ok || !r.AtEnd())
+	{
+		return false;
+	}
+
+	state.Apply(chip8);
+	RestoreMemory(chip8, pages);
+	return true;
+}
+
+inline bool LoadState(Chip8 &chip8, std::vector<uint8_t> const &state)
+{
+	return LoadState(chip8, state.data(), state.size());
+}
+
+// Hash of everything a save state holds, for comparing runs.
+inline uint64_t StateHash(Chip8 const &chip8)
+{
+	std::vector<uint8_t> state;
+	SaveState(chip8, state);
+	return Fnv1a(state.data(), state.size());
+}
@@ -0,0 +1,246 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+// Instruction trace sinks, chosen at compile time.
+//
+// NullTrace compiles to nothing. RingTrace (build with -DCHIP8_TRACE) packs a
+// binary record per instruction into a preallocated ring buffer of its
+// machine. One process-wide TraceWriter thread drains every ring to a single
+// file in batches, so fleets and comparison machines share the file instead
+// of truncating each other's. A machine's ring is only allocated, and the file
+// only opened, once it executes an instruction. The file name is taken from
+// the CHIP8_TRACE_FILE environment variable and defaults to chip8.trace.
+//
+// The file is a sequence of chunks (little endian):
+//   uint32 instance, uint32 length, then length bytes of whole records
+// where instance numbers machines in the order they were constructed.
+// Record layout:
+//   uint16 pc, uint16 opcode, uint16 index, uint16 changed
+//   followed by one byte per set bit of `changed`: the new value of that register
+
+struct NullTrace
+{
+	static constexpr bool enabled = false;
+
+	void Record(uint16_t, uint16_t, uint16_t, uint8_t const *, uint8_t const *) {}
+};
+
+// One machine's records; written by the machine, read by the TraceWriter.
+struct TraceRing
+{
+	static constexpr size_t SIZE = 256u << 10;
+
+	explicit TraceRing(uint32_t instance)
+		: data(new uint8_t[SIZE]), instance(instance)
+	{
+	}
+
+	std::unique_ptr<uint8_t[]> data;
+	std::atomic<size_t> head{0};
+	std::atomic<size_t> tail{0};
+	uint32_t instance;
+};
+
+class TraceWriter
+{
+public:
+	static TraceWriter &Get()
+	{
+		static TraceWriter writer;
+		return writer;
+	}
+
+	void Add(TraceRing *ring)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		rings.push_back(ring);
+	}
+
+	// Write out what is left in ring and stop draining it.
+	void Remove(TraceRing *ring)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Flush(*ring);
+		rings.erase(std::find(rings.begin(), rings.end(), ring));
+	}
+
+	void Wake() { wake.notify_one(); }
+
+private:
+	TraceWriter()
+	{
+		char const *filename = std::getenv("CHIP8_TRACE_FILE");
+		file = std::fopen(filename ? filename : "chip8.trace", "wb");
+		drainer = std::thread(&TraceWriter::Drain, this);
+	}
+
+	~TraceWriter()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_one();
+		drainer.join();
+
+		if (file)
+		{
+			std::fclose(file);
+		}
+	}
+
+	// mutex held
+	void Flush(TraceRing &ring)
+	{
+		size_t t = ring.tail.load(std::memory_order_relaxed);
+		size_t h = ring.head.load(std::memory_order_acquire);
+		size_t length = h - t;
+
+		if (length == 0)
+		{
+			return;
+		}
+
+		if (file)
+		{
+			// one chunk even across the wrap, so no record is split
+			uint8_t header[8];
+			for (int i = 0; i < 4; i++)
+			{
+				header[i] = static_cast<uint8_t>(ring.instance >> (8 * i));
+				header[4 + i] = static_cast<uint8_t>(length >> (8 * i));
+			}
+			std::fwrite(header, 1, sizeof(header), file);
+
+			size_t start = t & (TraceRing::SIZE - 1);
+			size_t first = std::min(length, TraceRing::SIZE - start);
+			std::fwrite(ring.data.get() + start, 1, first, file);
+			std::fwrite(ring.data.get(), 1, length - first, file);
+		}
+
+		ring.tail.store(h, std::memory_order_release);
+	}
+
+	void Drain()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			for (TraceRing *ring : rings)
+			{
+				Flush(*ring);
+			}
+
+			if (stop)
+			{
+				return;
+			}
+
+			wake.wait_for(lock, std::chrono::milliseconds(10));
+		}
+	}
+
+	std::vector<TraceRing *> rings;
+	bool stop = false;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::thread drainer;
+	FILE *file = nullptr;
+};
+
+class RingTrace
+{
+public:
+	static constexpr bool enabled = true;
+	static constexpr size_t BATCH_SIZE = 64u << 10;
+	static constexpr size_t MAX_RECORD = 8 + 16;
+
+	RingTrace() : instance(instances.fetch_add(1, std::memory_order_relaxed)) {}
+
+	~RingTrace()
+	{
+		if (ring)
+		{
+			TraceWriter::Get().Remove(ring.get());
+		}
+	}
+
+	RingTrace(RingTrace const &) = delete;
+	RingTrace &operator=(RingTrace const &) = delete;
+
+	void Record(uint16_t pc, uint16_t opcode, uint16_t index, uint8_t const *before, uint8_t const *after)
+	{
+		if (!ring)
+		{
+			ring = std::make_unique<TraceRing>(instance);
+			TraceWriter::Get().Add(ring.get());
+		}
+
+		size_t h = ring->head.load(std::memory_order_relaxed);
+
+		// wait for the drainer if the ring is about to overflow
+		while (TraceRing::SIZE - (h - ring->tail.load(std::memory_order_acquire)) < MAX_RECORD)
+		{
+			TraceWriter::Get().Wake();
+			std::this_thread::yield();
+		}
+
+		uint8_t record[MAX_RECORD];
+		uint16_t changed = 0;
+		size_t length = 8;
+
+		for (int i = 0; i < 16; i++)
+		{
+			if (before[i] != after[i])
+			{
+				changed |= 1u << i;
+				record[length++] = after[i];
+			}
+		}
+
+		record[0] = pc & 0xFFu;
+		record[1] = pc >> 8u;
+		record[2] = opcode & 0xFFu;
+		record[3] = opcode >> 8u;
+		record[4] = index & 0xFFu;
+		record[5] = index >> 8u;
+		record[6] = changed & 0xFFu;
+		record[7] = changed >> 8u;
+
+		for (size_t i = 0; i < length; i++)
+		{
+			ring->data[(h + i) & (TraceRing::SIZE - 1)] = record[i];
+		}
+
+		ring->head.store(h + length, std::memory_order_release);
+
+		// only wake the drainer once per batch so the hot path stays syscall free
+		if ((h & ~(BATCH_SIZE - 1)) != ((h + length) & ~(BATCH_SIZE - 1)))
+		{
+			TraceWriter::Get().Wake();
+		}
+	}
+
+private:
+	static inline std::atomic<uint32_t> instances{0};
+
+	std::unique_ptr<TraceRing> ring; // allocated on the first record
+	uint32_t instance;
+};
+
+#ifdef CHIP8_TRACE
+typedef RingTrace TraceSink;
+#else
+typedef NullTrace TraceSink;
+#endif